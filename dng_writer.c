@@ -0,0 +1,333 @@
+/*****************************************************************************
+ * dng_writer: lays out a DNG in one forward pass without libtiff
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // writev
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "dng_writer.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define TAG_STRIPOFFSETS 273
+#define TAG_STRIPBYTECOUNTS 279
+#define TAG_TILEOFFSETS 324
+#define TAG_TILEBYTECOUNTS 325
+#define TAG_EXIFIFD 34665
+
+static const int type_sizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4 };
+
+void dng_ifd_init( dng_ifd *ifd )
+{
+    memset( ifd, 0, sizeof( dng_ifd ) );
+}
+
+void dng_ifd_free( dng_ifd *ifd )
+{
+    for( int i = 0; i < ifd->count; i++ )
+        free( ifd->entries[i].values );
+    ifd->count = 0;
+}
+
+int dng_set( dng_ifd *ifd, uint16_t tag, int type, uint32_t count, const void *values )
+{
+    dng_entry *e = NULL;
+    for( int i = 0; i < ifd->count && !e; i++ )
+    {
+        if( ifd->entries[i].tag == tag )
+            e = &ifd->entries[i];
+    }
+    if( !e )
+    {
+        if( ifd->count == DNG_MAX_ENTRIES )
+            return -1;
+        e = &ifd->entries[ifd->count++];
+        e->values = NULL;
+    }
+
+    const size_t size = (size_t)count * type_sizes[type];
+    uint8_t *copy = malloc( size ? size : 1 );
+    if( !copy )
+        return -1;
+    if( values )
+        memcpy( copy, values, size );
+    else
+        memset( copy, 0, size );
+    free( e->values );
+    e->tag = tag;
+    e->type = type;
+    e->count = count;
+    e->values = copy;
+    return 0;
+}
+
+int dng_set_short( dng_ifd *ifd, uint16_t tag, uint16_t value )
+{
+    return dng_set( ifd, tag, DNG_SHORT, 1, &value );
+}
+
+int dng_set_long( dng_ifd *ifd, uint16_t tag, uint32_t value )
+{
+    return dng_set( ifd, tag, DNG_LONG, 1, &value );
+}
+
+int dng_set_ascii( dng_ifd *ifd, uint16_t tag, const char *value )
+{
+    return dng_set( ifd, tag, DNG_ASCII, (uint32_t)strlen( value ) + 1, value );
+}
+
+// Walk the continued fraction of value until it matches to float precision or the terms stop fitting
+static void to_fraction( double value, uint32_t limit, uint32_t *num, uint32_t *den )
+{
+    uint64_t h0 = 0, h1 = 1, k0 = 1, k1 = 0;
+    double x = value;
+    for( int i = 0; i < 64; i++ )
+    {
+        const double a = floor( x );
+        if( a > limit )
+            break;
+        const uint64_t h2 = (uint64_t)a * h1 + h0, k2 = (uint64_t)a * k1 + k0;
+        if( h2 > limit || k2 > limit )
+            break;
+        h0 = h1; h1 = h2;
+        k0 = k1; k1 = k2;
+        if( x - a < 1e-12 || fabs( value - (double)h1 / k1 ) <= value * 1e-7 )
+            break;
+        x = 1.0 / (x - a);
+    }
+    if( k1 == 0 )
+    {
+        // Too big to represent at all
+        h1 = limit;
+        k1 = 1;
+    }
+    *num = (uint32_t)h1;
+    *den = (uint32_t)k1;
+}
+
+int dng_set_rational( dng_ifd *ifd, uint16_t tag, int type, uint32_t count, const float *values )
+{
+    uint32_t *fractions = malloc( count * 2 * sizeof( uint32_t ) );
+    if( !fractions )
+        return -1;
+    for( uint32_t i = 0; i < count; i++ )
+    {
+        double v = values[i];
+        if( type == DNG_SRATIONAL )
+        {
+            to_fraction( fabs( v ), INT32_MAX, &fractions[i * 2], &fractions[i * 2 + 1] );
+            if( v < 0 )
+                fractions[i * 2] = (uint32_t)-(int32_t)fractions[i * 2];
+        }
+        else
+            to_fraction( v > 0 ? v : 0, UINT32_MAX, &fractions[i * 2], &fractions[i * 2 + 1] );
+    }
+    int ret = dng_set( ifd, tag, type, count, fractions );
+    free( fractions );
+    return ret;
+}
+
+static int compare_entries( const void *a, const void *b )
+{
+    return (int)((const dng_entry*)a)->tag - (int)((const dng_entry*)b)->tag;
+}
+
+static uint32_t value_size( const dng_entry *e )
+{
+    return e->count * type_sizes[e->type];
+}
+
+// Bytes taken by an IFD and the values that don't fit in its entries, kept word aligned
+static uint64_t ifd_size( const dng_ifd *ifd )
+{
+    uint64_t size = 2 + ifd->count * 12 + 4;
+    for( int i = 0; i < ifd->count; i++ )
+    {
+        if( value_size( &ifd->entries[i] ) > 4 )
+            size += (value_size( &ifd->entries[i] ) + 1) & ~1u;
+    }
+    return size;
+}
+
+// Serialize an IFD that starts at file offset, followed by its values. There's no next IFD.
+static void put_ifd( uint8_t *buf, uint32_t offset, const dng_ifd *ifd )
+{
+    const uint16_t count = ifd->count;
+    const uint32_t next = 0;
+    uint32_t data = offset + 2 + count * 12 + 4;
+    uint8_t *p = buf;
+
+    memcpy( p, &count, 2 );
+    p += 2;
+    for( int i = 0; i < count; i++, p += 12 )
+    {
+        const dng_entry *e = &ifd->entries[i];
+        const uint32_t size = value_size( e );
+        memcpy( p, &e->tag, 2 );
+        memcpy( p + 2, &e->type, 2 );
+        memcpy( p + 4, &e->count, 4 );
+        memset( p + 8, 0, 4 );
+        if( size <= 4 )
+            memcpy( p + 8, e->values, size );
+        else
+        {
+            memcpy( p + 8, &data, 4 );
+            memcpy( buf + (data - offset), e->values, size );
+            if( size & 1 )
+                buf[data - offset + size] = 0;
+            data += (size + 1) & ~1u;
+        }
+    }
+    memcpy( p, &next, 4 );
+}
+
+#ifndef _WIN32
+static int write_all( int fd, struct iovec *iov, int count )
+{
+    while( count > 0 )
+    {
+        ssize_t n = writev( fd, iov, count > IOV_MAX ? IOV_MAX : count );
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        while( count > 0 && (size_t)n >= iov->iov_len )
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if( count > 0 )
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+#endif
+
+int dng_write( const char *path, dng_ifd *ifd0, dng_ifd *exif, int tiled,
+               const dng_chunk *chunks, int chunk_count )
+{
+    int status = -1;
+    uint8_t *meta = NULL;
+
+    // Reserve the entries that point into the file, then lay everything out
+    if( dng_set( ifd0, tiled ? TAG_TILEOFFSETS : TAG_STRIPOFFSETS, DNG_LONG, chunk_count, NULL ) ||
+        dng_set( ifd0, tiled ? TAG_TILEBYTECOUNTS : TAG_STRIPBYTECOUNTS, DNG_LONG, chunk_count, NULL ) ||
+        (exif && dng_set( ifd0, TAG_EXIFIFD, DNG_IFD, 1, NULL )) )
+        return -1;
+    qsort( ifd0->entries, ifd0->count, sizeof( dng_entry ), compare_entries );
+    if( exif )
+        qsort( exif->entries, exif->count, sizeof( dng_entry ), compare_entries );
+
+    const uint64_t ifd0_offset = 8;
+    const uint64_t exif_offset = ifd0_offset + ifd_size( ifd0 );
+    const uint64_t data_offset = exif_offset + (exif ? ifd_size( exif ) : 0);
+    uint64_t end = data_offset;
+    for( int i = 0; i < chunk_count; i++ )
+        end += chunks[i].length;
+    if( end > UINT32_MAX )
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint32_t offset = (uint32_t)data_offset;
+    for( int i = 0; i < ifd0->count; i++ )
+    {
+        dng_entry *e = &ifd0->entries[i];
+        uint32_t *values = (uint32_t*)e->values;
+        if( e->tag == TAG_TILEOFFSETS || e->tag == TAG_STRIPOFFSETS )
+        {
+            for( int j = 0; j < chunk_count; j++ )
+            {
+                values[j] = offset;
+                offset += chunks[j].length;
+            }
+        }
+        else if( e->tag == TAG_TILEBYTECOUNTS || e->tag == TAG_STRIPBYTECOUNTS )
+        {
+            for( int j = 0; j < chunk_count; j++ )
+                values[j] = chunks[j].length;
+        }
+        else if( e->tag == TAG_EXIFIFD )
+            values[0] = (uint32_t)exif_offset;
+    }
+
+    // Header and both IFDs go out as one block ahead of the image data
+    const uint16_t one = 1;
+    const uint16_t magic = 42;
+    const uint32_t first_ifd = (uint32_t)ifd0_offset;
+    if( (meta = calloc( 1, data_offset )) == NULL )
+        return -1;
+    memset( meta, *(const uint8_t*)&one ? 'I' : 'M', 2 );
+    memcpy( meta + 2, &magic, 2 );
+    memcpy( meta + 4, &first_ifd, 4 );
+    put_ifd( meta + ifd0_offset, (uint32_t)ifd0_offset, ifd0 );
+    if( exif )
+        put_ifd( meta + exif_offset, (uint32_t)exif_offset, exif );
+
+#ifdef _WIN32
+    FILE *f = fopen( path, "wb" );
+    if( !f )
+        goto fail;
+    int ok = fwrite( meta, 1, data_offset, f ) == data_offset;
+    for( int i = 0; ok && i < chunk_count; i++ )
+        ok = fwrite( chunks[i].data, 1, chunks[i].length, f ) == chunks[i].length;
+    if( fclose( f ) || !ok )
+        goto fail;
+#else
+    struct iovec *iov = malloc( (chunk_count + 1) * sizeof( struct iovec ) );
+    if( !iov )
+        goto fail;
+    iov[0].iov_base = meta;
+    iov[0].iov_len = data_offset;
+    for( int i = 0; i < chunk_count; i++ )
+    {
+        iov[i + 1].iov_base = (void*)chunks[i].data;
+        iov[i + 1].iov_len = chunks[i].length;
+    }
+    int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 )
+    {
+        free( iov );
+        goto fail;
+    }
+    int ret = write_all( fd, iov, chunk_count + 1 );
+    free( iov );
+    if( close( fd ) || ret )
+        goto fail;
+#endif
+
+    status = 0;
+fail:
+    free( meta );
+    return status;
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+ * dng_writer: lays out a DNG in one forward pass without libtiff
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef DNG_WRITER_H
+#define DNG_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// TIFF field types, numbered as in the TIFF 6.0 spec
+enum dng_type
+{
+    DNG_BYTE = 1,
+    DNG_ASCII = 2,
+    DNG_SHORT = 3,
+    DNG_LONG = 4,
+    DNG_RATIONAL = 5,
+    DNG_UNDEFINED = 7,
+    DNG_SRATIONAL = 10,
+    DNG_IFD = 13,
+};
+
+#define DNG_MAX_ENTRIES 64
+
+typedef struct
+{
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint8_t *values;        // count values of type, in host byte order
+} dng_entry;
+
+// The tags of one IFD, in any order. Setting a tag twice replaces it.
+typedef struct
+{
+    dng_entry entries[DNG_MAX_ENTRIES];
+    int count;
+} dng_ifd;
+
+// The image data of IFD0, in tile or strip order
+typedef struct
+{
+    const void *data;
+    uint32_t length;
+} dng_chunk;
+
+void dng_ifd_init( dng_ifd *ifd );
+void dng_ifd_free( dng_ifd *ifd );
+
+// All of these return 0 on success, or -1 if the IFD is full or out of memory
+int dng_set( dng_ifd *ifd, uint16_t tag, int type, uint32_t count, const void *values );
+int dng_set_short( dng_ifd *ifd, uint16_t tag, uint16_t value );
+int dng_set_long( dng_ifd *ifd, uint16_t tag, uint32_t value );
+int dng_set_ascii( dng_ifd *ifd, uint16_t tag, const char *value );
+
+// Rationals are given as floats and stored as the closest fraction that fits
+int dng_set_rational( dng_ifd *ifd, uint16_t tag, int type, uint32_t count, const float *values );
+
+/*
+ * Write a little- or big-endian (whatever this machine is) DNG with the
+ * header, IFD0, the EXIF IFD when exif is given, then the image data, in
+ * that order. TileOffsets/TileByteCounts or StripOffsets/StripByteCounts and
+ * ExifIFD are filled in here, so the caller shouldn't set them. Returns 0 on
+ * success.
+ */
+int dng_write( const char *path, dng_ifd *ifd0, dng_ifd *exif, int tiled,
+               const dng_chunk *chunks, int chunk_count );
+
+#endif
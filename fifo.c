@@ -0,0 +1,106 @@
+/*****************************************************************************
+ * fifo: a bounded single-producer, single-consumer queue between threads
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+
+#include "threads.h"
+#include "fifo.h"
+
+struct fifo
+{
+    void **items;
+    long depth;
+    volatile long head;     // Items popped, only advanced by the consumer
+    volatile long tail;     // Items pushed, only advanced by the producer
+    volatile long sleepers;
+    mutex_t lock;           // Only guards sleeping and waking
+    cond_t changed;
+};
+
+fifo *fifo_create( int depth )
+{
+    fifo *f = calloc( 1, sizeof( fifo ) );
+    if( !f )
+        return NULL;
+    if( depth < 1 )
+        depth = 1;
+    if( (f->items = calloc( depth, sizeof( void* ) )) == NULL )
+    {
+        free( f );
+        return NULL;
+    }
+    f->depth = depth;
+    mutex_init( &f->lock );
+    cond_init( &f->changed );
+    return f;
+}
+
+static int is_full( fifo *f )
+{
+    return atomic_get( &f->tail ) - atomic_get( &f->head ) == f->depth;
+}
+
+static int is_empty( fifo *f )
+{
+    return atomic_get( &f->tail ) == atomic_get( &f->head );
+}
+
+// Sleep while blocked( f ). Raising the sleeper count before checking means the
+// other side either sees us in wake() or we see its update.
+static void wait_while( fifo *f, int (*blocked)( fifo* ) )
+{
+    while( blocked( f ) )
+    {
+        mutex_lock( &f->lock );
+        atomic_add( &f->sleepers, 1 );
+        if( blocked( f ) )
+            cond_wait( &f->changed, &f->lock );
+        atomic_add( &f->sleepers, -1 );
+        mutex_unlock( &f->lock );
+    }
+}
+
+static void wake( fifo *f )
+{
+    if( atomic_get( &f->sleepers ) == 0 )
+        return;
+    mutex_lock( &f->lock );
+    cond_broadcast( &f->changed );
+    mutex_unlock( &f->lock );
+}
+
+void fifo_push( fifo *f, void *item )
+{
+    wait_while( f, is_full );
+    f->items[f->tail % f->depth] = item;
+    atomic_add( &f->tail, 1 );
+    wake( f );
+}
+
+void *fifo_pop( fifo *f )
+{
+    wait_while( f, is_empty );
+    void *item = f->items[f->head % f->depth];
+    atomic_add( &f->head, 1 );
+    wake( f );
+    return item;
+}
+
+void fifo_destroy( fifo *f )
+{
+    if( !f )
+        return;
+    cond_destroy( &f->changed );
+    mutex_destroy( &f->lock );
+    free( f->items );
+    free( f );
+}
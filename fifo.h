@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * fifo: a bounded single-producer, single-consumer queue between threads
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef FIFO_H
+#define FIFO_H
+
+typedef struct fifo fifo;
+
+// A queue holding up to depth items. Returns NULL if out of memory.
+fifo *fifo_create( int depth );
+
+/*
+ * Exactly one thread may push and one thread may pop. Neither takes a lock
+ * unless the queue is full or empty, in which case the caller sleeps until
+ * the other side makes room or adds an item.
+ */
+void fifo_push( fifo *f, void *item );
+void *fifo_pop( fifo *f );
+
+void fifo_destroy( fifo *f );
+
+#endif
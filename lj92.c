@@ -28,6 +28,25 @@ SOFTWARE.
 
 #include "lj92.h"
 
+// Vector kernels for the encoder are built for x86 and picked at runtime
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define LJ92_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LJ92_TARGET(isa)
+#else
+#define LJ92_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Kernels are specialized by inlining a generic body with constant arguments
+#ifdef _MSC_VER
+#define LJ92_INLINE static __forceinline
+#else
+#define LJ92_INLINE static inline __attribute__((always_inline))
+#endif
+
 #ifdef _MSC_VER
 static inline int __builtin_clzl( unsigned long mask )
 {
@@ -58,14 +77,19 @@ typedef struct _ljp {
     int datalen;
     int scanstart;
     int ix;
-    int x; // Width
+    int x; // Width in samples, all components of a pixel next to each other
     int y; // Height
+    int components; // Per pixel
     int bits; // Bit depth
     int writelen; // Write rows this long
     int skiplen; // Skip this many values after each row
+    int writeleft; // Values to write before the first skip
+    int restart; // Pixels per restart interval (DRI), 0 for none
+    int predictor;
+    int pointTransform; // Low bits dropped by the encoder, restored by shifting back
     u16* linearize; // Linearization table
     int linlen;
-    int sssshist[16];
+    int sssshist[17];
 
     // Huffman table - only one supported, and probably needed
 #ifdef SLOW_HUFF
@@ -85,6 +109,9 @@ typedef struct _ljp {
     u16* image;
     u16* rowcache;
     u16* outrow[2];
+    // Runs the restart intervals of a scan, see lj92_set_parallel
+    lj92_parallel parallel;
+    void* parallelContext;
 } ljp;
 
 static int find(ljp* self) {
@@ -282,14 +309,23 @@ static int parseHuff(ljp* self) {
 }
 
 static int parseSof3(ljp* self) {
-    if (self->ix+6 >= self->datalen) return LJ92_ERROR_CORRUPT;
+    if (self->ix+7 >= self->datalen) return LJ92_ERROR_CORRUPT;
     self->y = BEH(self->data[self->ix+3]);
-    self->x = BEH(self->data[self->ix+5]);
+    self->components = self->data[self->ix+7];
+    if (self->components<1 || self->components>4) return LJ92_ERROR_CORRUPT;
+    self->x = BEH(self->data[self->ix+5]) * self->components;
     self->bits = self->data[self->ix+2];
     self->ix += BEH(self->data[self->ix]);
     return LJ92_ERROR_NONE;
 }
 
+static int parseDri(ljp* self) {
+    if (self->ix+3 >= self->datalen) return LJ92_ERROR_CORRUPT;
+    self->restart = BEH(self->data[self->ix+2]);
+    self->ix += BEH(self->data[self->ix]);
+    return LJ92_ERROR_NONE;
+}
+
 static int parseBlock(ljp* self,int marker) {
     self->ix += BEH(self->data[self->ix]);
     if (self->ix >= self->datalen) return LJ92_ERROR_CORRUPT;
@@ -352,8 +388,11 @@ static int extend(ljp* self,int v,int t) {
 inline static int nextdiff(ljp* self, int Px) {
 #ifdef SLOW_HUFF
     int t = decode(self);
-    int diff = receive(self,t);
-    diff = extend(self,diff,t);
+    int diff = 0;
+    if (t == 16)
+        diff = 32768; // No bits follow
+    else if (t > 0)
+        diff = extend(self,receive(self,t),t);
     //printf("%d %d %d %x\n",Px+diff,Px,diff,t);//,index,usedbits);
 #else
     u32 b = self->b;
@@ -382,6 +421,13 @@ inline static int nextdiff(ljp* self, int Px) {
     cnt -= usedbits;
     int keepbitsmask = (1 << cnt)-1;
     b &= keepbitsmask;
+    if (t == 0 || t == 16) {
+        // Nothing follows the code. A 16 is a difference of 32768.
+        self->b = b;
+        self->cnt = cnt;
+        self->ix = ix;
+        return t == 16 ? 32768 : 0;
+    }
     while (cnt < t) {
         next = *(u16*)&self->data[ix];
         int one = next&0xFF;
@@ -413,107 +459,168 @@ inline static int nextdiff(ljp* self, int Px) {
     return diff;
 }
 
-static int parsePred6(ljp* self) {
-    int ret = LJ92_ERROR_CORRUPT;
-    self->ix = self->scanstart;
-    //int compcount = self->data[self->ix+2];
-    self->ix += BEH(self->data[self->ix]);
+/* Kernels for decoding a scan, one for each predictor with and without a
+ * linearization table, so the inner loop has neither to look at. The bit
+ * depth only sets where the first sample is predicted from.
+ * Px is the prediction from left, up and upleft, STORE puts a sample out.
+ */
+#define DECODE_ROWS(Px,STORE) \
+    for (int row=0;row<self->y;row++) { \
+        int col = 0; \
+        if (row==0) { \
+            /* The first row is predicted from the left, and its first pixel from half the range */ \
+            for (;col<step;col++) { \
+                int v = ((1 << (self->bits-pt-1)) + nextdiff(self,0)) & 0xFFFF; \
+                thisrow[col] = v; \
+                STORE(v); \
+            } \
+            for (;col<x;col++) { \
+                int v = (thisrow[col-step] + nextdiff(self,0)) & 0xFFFF; \
+                thisrow[col] = v; \
+                STORE(v); \
+            } \
+        } else { \
+            /* The first pixel of other rows is predicted from above */ \
+            for (;col<step;col++) { \
+                int v = (lastrow[col] + nextdiff(self,0)) & 0xFFFF; \
+                thisrow[col] = v; \
+                STORE(v); \
+            } \
+            for (;col<x;col++) { \
+                int left = thisrow[col-step], up = lastrow[col], upleft = lastrow[col-step]; \
+                (void)left; (void)up; (void)upleft; \
+                int v = ((Px) + nextdiff(self,0)) & 0xFFFF; /* Differences are modulo 2^16 */ \
+                thisrow[col] = v; \
+                STORE(v); \
+            } \
+        } \
+        u16* temprow = lastrow; \
+        lastrow = thisrow; \
+        thisrow = temprow; \
+        /* Checked once a row, since the reader looks a code ahead and can be */ \
+        /* past the end well before the last few short codes are used */ \
+        if (self->ix >= self->datalen+2 && row+1 < self->y) return LJ92_ERROR_CORRUPT; \
+    }
+
+#define DECODE_SCAN(STORE) \
+    switch (self->predictor) { \
+    case 0: DECODE_ROWS(0,STORE); break; /* No prediction... should not be used */ \
+    case 1: DECODE_ROWS(left,STORE); break; \
+    case 2: DECODE_ROWS(up,STORE); break; \
+    case 3: DECODE_ROWS(upleft,STORE); break; \
+    case 4: DECODE_ROWS(left + up - upleft,STORE); break; \
+    case 5: DECODE_ROWS(left + ((up - upleft)>>1),STORE); break; \
+    case 6: DECODE_ROWS(up + ((left - upleft)>>1),STORE); break; \
+    case 7: DECODE_ROWS((left + up)>>1,STORE); break; \
+    }
+
+// Samples are written writelen at a time, skipping skiplen after each run
+#define STORE_SAMPLE(v) \
+    *out++ = (v) << pt; \
+    if (--write==0) { \
+        out += self->skiplen; \
+        write = self->writelen; \
+    }
+
+#define STORE_LINEARIZED(v) \
+    if (((v) << pt) >= self->linlen) return LJ92_ERROR_CORRUPT; \
+    *out++ = self->linearize[(v) << pt]; \
+    if (--write==0) { \
+        out += self->skiplen; \
+        write = self->writelen; \
+    }
+
+/* Decode self->y rows of entropy coded data starting at self->ix, the first
+ * of them predicted as the first row of the image.
+ */
+static int decodeScan(ljp* self) {
     self->cnt = 0;
     self->b = 0;
-    int write = self->writelen;
-    // Now need to decode huffman coded values
-    int c = 0;
-    int pixels = self->y * self->x;
+    // Each sample is predicted from the same component of the neighbouring pixels
+    int step = self->components;
+    int x = self->x;
+    // Samples were divided by 2^pt before prediction, see lj92_encoder_set_point_transform
+    int pt = self->pointTransform;
+    int write = self->writeleft;
     u16* out = self->image;
-    u16* temprow;
     u16* thisrow = self->outrow[0];
     u16* lastrow = self->outrow[1];
+    if (self->linearize) {
+        DECODE_SCAN(STORE_LINEARIZED);
+    } else {
+        DECODE_SCAN(STORE_SAMPLE);
+    }
+    return LJ92_ERROR_NONE;
+}
+#undef DECODE_ROWS
+#undef DECODE_SCAN
+#undef STORE_SAMPLE
+#undef STORE_LINEARIZED
+
+typedef struct _ljpInterval {
+    ljp dec; // A copy of the decoder positioned at the interval
+    int ret;
+} ljpInterval;
+
+static void decodeInterval(void* arg,int index) {
+    ljpInterval* interval = &((ljpInterval*)arg)[index];
+    interval->ret = decodeScan(&interval->dec);
+}
 
-    // First pixel predicted from base value
-    int diff;
-    int Px;
-    int col = 0;
-    int row = 0;
-    int left = 0;
-    int linear;
-
-    // First pixel
-    diff = nextdiff(self,0);
-    Px = 1 << (self->bits-1);
-    left = Px + diff;
-    if (self->linearize)
-        linear = self->linearize[left];
-    else
-        linear = left;
-    thisrow[col++] = left;
-    out[c++] = linear;
-    if (self->ix >= self->datalen) return ret;
-    --write;
-    int rowcount = self->x-1;
-    while (rowcount--) {
-        diff = nextdiff(self,0);
-        Px = left;
-        left = Px + diff;
-        if (self->linearize)
-            linear = self->linearize[left];
-        else
-            linear = left;
-        thisrow[col++] = left;
-        out[c++] = linear;
-        //printf("%d %d %d %d %x\n",col-1,diff,left,thisrow[col-1],&thisrow[col-1]);
-        if (self->ix >= self->datalen) return ret;
-        if (--write==0) {
-            out += self->skiplen;
-            write = self->writelen;
-        }
+static void runSerially(void* context,int count,void (*task)(void* arg,int index),void* arg) {
+    for (int i=0;i<count;i++) task(arg,i);
+}
+
+/* A scan with restart intervals is cut at its RSTn markers, and each piece
+ * decoded on its own copy of the decoder, as the prediction starts over at
+ * every one of them.
+ */
+static int parseRestarts(ljp* self) {
+    int ret = LJ92_ERROR_CORRUPT;
+    int pixels = self->x/self->components;
+    // Intervals that aren't whole rows would start mid-row, which nothing writes
+    if (self->restart % pixels) return ret;
+    int rows = self->restart/pixels;
+    int count = (self->y + rows - 1)/rows;
+    ljpInterval* intervals = (ljpInterval*)calloc(count,sizeof(ljpInterval));
+    u16* rowcache = (u16*)malloc((size_t)count*self->x*2*sizeof(u16));
+    if (intervals==NULL || rowcache==NULL) {
+        ret = LJ92_ERROR_NO_MEMORY;
+        goto done;
     }
-    temprow = lastrow;
-    lastrow = thisrow;
-    thisrow = temprow;
-    row++;
-    //printf("%x %x\n",thisrow,lastrow);
-    while (c<pixels) {
-        col = 0;
-        diff = nextdiff(self,0);
-        Px = lastrow[col]; // Use value above for first pixel in row
-        left = Px + diff;
-        if (self->linearize) {
-            if (left>self->linlen) return LJ92_ERROR_CORRUPT;
-            linear = self->linearize[left];
-        } else
-            linear = left;
-        thisrow[col++] = left;
-        //printf("%d %d %d %d\n",col,diff,left,lastrow[col]);
-        out[c++] = linear;
-        if (self->ix >= self->datalen) break;
-        rowcount = self->x-1;
-        if (--write==0) {
-            out += self->skiplen;
-            write = self->writelen;
-        }
-        while (rowcount--) {
-            diff = nextdiff(self,0);
-            Px = lastrow[col] + ((left - lastrow[col-1])>>1);
-            left = Px + diff;
-            //printf("%d %d %d %d %d %x\n",col,diff,left,lastrow[col],lastrow[col-1],&lastrow[col]);
-            if (self->linearize) {
-                if (left>self->linlen) return LJ92_ERROR_CORRUPT;
-                linear = self->linearize[left];
-            } else
-                linear = left;
-            thisrow[col++] = left;
-            out[c++] = linear;
-            if (--write==0) {
-                out += self->skiplen;
-                write = self->writelen;
-            }
+    int ix = self->ix;
+    for (int i=0;i<count;i++) {
+        ljp* dec = &intervals[i].dec;
+        *dec = *self;
+        dec->ix = ix;
+        dec->y = i<count-1 ? rows : self->y - i*rows;
+        dec->outrow[0] = &rowcache[(size_t)i*self->x*2];
+        dec->outrow[1] = &rowcache[(size_t)i*self->x*2 + self->x];
+        int64_t pos = (int64_t)i*rows*self->x;
+        dec->image = &self->image[pos/self->writelen*(self->writelen+self->skiplen) + pos%self->writelen];
+        dec->writeleft = self->writelen - (int)(pos%self->writelen);
+        if (i==count-1) break;
+        // Skip to just past the next marker, which has to be RSTn for this interval
+        while (1) {
+            if (ix >= self->datalen-1) goto done;
+            u8* ff = (u8*)memchr(&self->data[ix],0xff,self->datalen-1-ix);
+            if (ff==NULL) goto done;
+            ix = (int)(ff - self->data) + 1;
+            if (self->data[ix]==0x00 || self->data[ix]==0xff) continue; // Stuffing or fill
+            if (self->data[ix] != 0xd0+(i&7)) goto done;
+            ix++;
+            break;
         }
-        temprow = lastrow;
-        lastrow = thisrow;
-        thisrow = temprow;
-        if (self->ix >= self->datalen) break;
     }
-    if (c >= pixels) ret = LJ92_ERROR_NONE;
+    lj92_parallel run = self->parallel ? self->parallel : runSerially;
+    run(self->parallelContext,count,decodeInterval,intervals);
+    ret = LJ92_ERROR_NONE;
+    for (int i=0;i<count;i++) {
+        if (intervals[i].ret != LJ92_ERROR_NONE) ret = intervals[i].ret;
+    }
+done:
+    free(intervals);
+    free(rowcache);
     return ret;
 }
 
@@ -523,83 +630,16 @@ static int parseScan(ljp* self) {
     self->ix = self->scanstart;
     int compcount = self->data[self->ix+2];
     int pred = self->data[self->ix+3+2*compcount];
+    int pt = self->data[self->ix+5+2*compcount] & 0xf; // Al, Ah is unused
     if (pred<0 || pred>7) return ret;
-    if (pred==6) return parsePred6(self); // Fast path
+    if (compcount!=self->components) return ret;
+    if (pt>=self->bits) return ret;
+    self->predictor = pred;
+    self->pointTransform = pt;
     self->ix += BEH(self->data[self->ix]);
-    self->cnt = 0;
-    self->b = 0;
-    int write = self->writelen;
-    // Now need to decode huffman coded values
-    int c = 0;
-    int pixels = self->y * self->x;
-    u16* out = self->image;
-    u16* thisrow = self->outrow[0];
-    u16* lastrow = self->outrow[1];
-
-    // First pixel predicted from base value
-    int diff;
-    int Px = 0;
-    int col = 0;
-    int row = 0;
-    int left = 0;
-    while (c<pixels) {
-        if ((col==0)&&(row==0)) {
-            Px = 1 << (self->bits-1);
-        } else if (row==0) {
-            Px = left;
-        } else if (col==0) {
-            Px = lastrow[col]; // Use value above for first pixel in row
-        } else {
-            switch (pred) {
-            case 0:
-                Px = 0; break; // No prediction... should not be used
-            case 1:
-                Px = left; break;
-            case 2:
-                Px = lastrow[col]; break;
-            case 3:
-                Px = lastrow[col-1];break;
-            case 4:
-                Px = left + lastrow[col] - lastrow[col-1];break;
-            case 5:
-                Px = left + ((lastrow[col] - lastrow[col-1])>>1);break;
-            /* case 6 has a shortcut above
-            case 6:
-                Px = lastrow[col] + ((left - lastrow[col-1])>>1);break;
-            */
-            case 7:
-                Px = (left + lastrow[col])>>1;break;
-            }
-        }
-        diff = nextdiff(self,Px);
-        left = Px + diff;
-        //printf("%d %d %d\n",c,diff,left);
-        int linear;
-        if (self->linearize) {
-            if (left>self->linlen) return LJ92_ERROR_CORRUPT;
-            linear = self->linearize[left];
-        } else
-            linear = left;
-        thisrow[col] = left;
-        out[c++] = linear;
-        if (++col==self->x) {
-            col = 0;
-            row++;
-            u16* temprow = lastrow;
-            lastrow = thisrow;
-            thisrow = temprow;
-        }
-        if (--write==0) {
-            out += self->skiplen;
-            write = self->writelen;
-        }
-        if (self->ix >= self->datalen+2) break;
-    }
-    if (c >= pixels) ret = LJ92_ERROR_NONE;
-    /*for (int h=0;h<17;h++) {
-        printf("ssss:%d=%d (%f)\n",h,self->sssshist[h],(float)self->sssshist[h]/(float)(pixels));
-    }*/
-    return ret;
+    self->writeleft = self->writelen;
+    if (self->restart > 0) return parseRestarts(self);
+    return decodeScan(self);
 }
 
 static int parseImage(ljp* self) {
@@ -612,6 +652,8 @@ static int parseImage(ljp* self) {
             ret = parseSof3(self);
         else if (nextMarker == 0xfe)// Comment
             ret = parseBlock(self,nextMarker);
+        else if (nextMarker == 0xdd) // Restart interval
+            ret = parseDri(self);
         else if (nextMarker == 0xd9) // End of image
             break;
         else if (nextMarker == 0xda) {
@@ -707,6 +749,13 @@ int lj92_decode(lj92 lj,
     return ret;
 }
 
+void lj92_set_parallel(lj92 lj,lj92_parallel run,void* context) {
+    ljp* self = lj;
+    if (self==NULL) return;
+    self->parallel = run;
+    self->parallelContext = context;
+}
+
 void lj92_close(lj92 lj) {
     ljp* self = lj;
     if (self != NULL)
@@ -716,11 +765,84 @@ void lj92_close(lj92 lj) {
 
 /* Encoder implementation */
 
+// Predicts columns from to to of a row, for one predictor
+typedef void (*predictKernel)(const uint16_t* cur,const uint16_t* prev,int step,uint16_t* residual,uint8_t* ssss,int from,int to);
+
+/* Bit writer for the entropy coded segment.
+ * Codes are shifted into the bottom of a 64-bit accumulator and written out
+ * 32 bits at a time, so a whole Huffman code plus its extra bits (at most
+ * 16+16) can go in with one call.
+ */
+typedef struct _bitWriter {
+    uint64_t acc;
+    int count; // Bits in acc not yet written, always < 32 between calls
+    uint8_t* out;
+    int w;
+} bitWriter;
+
+static inline void writeByte(bitWriter* bw,uint8_t b) {
+    bw->out[bw->w++] = b;
+    if (b==0xff) bw->out[bw->w++] = 0x0;
+}
+
+static inline void writeBits(bitWriter* bw,uint32_t code,int length) {
+    bw->acc = (bw->acc << length) | code;
+    bw->count += length;
+    if (bw->count >= 32) {
+        bw->count -= 32;
+        uint32_t word = (uint32_t)(bw->acc >> bw->count);
+        uint8_t* o = &bw->out[bw->w];
+        // Only bytes that are 0xff need stuffing, and most words have none
+        uint32_t inv = ~word;
+        if (((inv - 0x01010101u) & ~inv & 0x80808080u) == 0) {
+            o[0] = word >> 24; o[1] = word >> 16; o[2] = word >> 8; o[3] = word;
+            bw->w += 4;
+        } else {
+            writeByte(bw,word >> 24);
+            writeByte(bw,word >> 16);
+            writeByte(bw,word >> 8);
+            writeByte(bw,word);
+        }
+    }
+}
+
+// Write whatever is left, padding the last byte with ones as the standard asks before a marker
+static inline void flushBits(bitWriter* bw) {
+    while (bw->count >= 8) {
+        bw->count -= 8;
+        writeByte(bw,bw->acc >> bw->count);
+    }
+    if (bw->count > 0) {
+        writeByte(bw,((bw->acc << (8 - bw->count)) | (0xff >> bw->count)) & 0xff);
+        bw->count = 0;
+    }
+}
+
+// Each SSSS category's Huffman code, ready to have the extra bits appended
+typedef struct _ljeCodes {
+    uint32_t huffenc[17];
+    int huffbits[17];
+    int extra[17];
+    int longest; // Code and extra bits of the longest category
+} ljeCodes;
+
+// One restart interval of the image being encoded
+typedef struct _ljeInterval {
+    int from; // Rows
+    int to;
+    int hist[17];
+    int start; // Where its codes go in the output
+    int end;
+    int ret;
+} ljeInterval;
+
 typedef struct _lje {
     uint16_t* image;
     int width;
     int height;
     int bitdepth;
+    int components; // Interleaved in each pixel, each predicted from its own kind
+    int samples; // Per row, width*components
     int readLength;
     int skipLength;
     uint16_t* delinearize;
@@ -728,144 +850,586 @@ typedef struct _lje {
     uint8_t* encoded;
     int encodedWritten;
     int encodedLength;
+    uint8_t** target; // Where encoded lives, for growing it mid-scan
+    int* targetLength;
+    uint16_t* rowcache; // Kept between calls, grown as needed
+    int rowcacheLength;
+    uint16_t* residual; // Per pixel: the ssss bits written after its huffman code
+    uint8_t* ssss; // Per pixel: its SSSS category
+    int residualLength;
+    uint8_t* buffer; // Output buffer used when the caller doesn't bring one
+    int bufferLength;
     int hist[17]; // SSSS frequency histogram
     int bits[17];
-    int huffval[17];
-    u16 huffenc[17];
-    u16 huffbits[17];
+    // Up to 17 categories plus the reserved code
+    int huffval[18];
+    u16 huffenc[18];
+    u16 huffbits[18];
     int huffsym[17];
+    int predictorChoice; // 1-7, or 0 to choose one per image
+    int pointTransform; // Low bits dropped from every sample, 0 for lossless
+    int predictor; // The one the current image is encoded with
+    int limit; // Longest stream worth writing, 0 for any, see lj92_encoder_set_limit
+    // Table reuse across images, see lj92_encoder_reuse_table
+    int trainImages; // 0 builds a new table for every image
+    int trained; // Images the current table was built from
+    int trainedPredictor; // Residuals the table was built from
+    int trainHist[17];
+    float trainedRatio; // Table cost over a fresh table's on what it was built from
+    // Restart intervals, see lj92_encoder_set_restart
+    int restartRows; // Asked for, 0 for none
+    int intervalRows; // Used for the current image, 0 for none
+    ljeInterval* intervals;
+    int intervalsLength;
+    lj92_parallel parallel;
+    void* parallelContext;
+    // Streaming, see lj92_encoder_begin
+    int streaming; // Between begin and finish
+    lj92_sink sink;
+    void* sinkContext;
+    int lookahead; // Rows held back to build the table from, 0 once it's built
+    int pushed; // Rows pushed so far
+    int streamReused; // The trained table was used as it was
+    const uint16_t* prevRow; // Predicts the next row pushed
+    ljeCodes codes;
+    bitWriter stream; // Codes in buffer that the sink hasn't had yet
+    int64_t rowWorst; // Room a row might need in buffer
+    int64_t sunk; // Bytes the sink has had
+    // Kernels chosen for this CPU when the encoder is created
+    const predictKernel* predictRow; // By predictor, 1-7
+    void (*histogram)(const uint8_t* ssss,int count,int* hist);
 } lje;
 
-int frequencyScan(lje* self) {
-    // Scan through the tile using the standard type 6 prediction
-    // Need to cache the previous 2 row in target coordinates because of tiling
-    uint16_t* pixel = self->image;
-    int pixcount = self->width*self->height;
-    int scan = self->readLength;
-    uint16_t* rowcache = (uint16_t*)calloc(1,self->width*4);
-    uint16_t* rows[2];
-    rows[0] = rowcache;
-    rows[1] = &rowcache[self->width];
-
-    int col = 0;
-    int row = 0;
-    int Px = 0;
-    int32_t diff = 0;
-    int maxval = (1 << self->bitdepth);
-    while (pixcount--) {
-        uint16_t p = *pixel;
-        if (self->delinearize) {
-            if (p>=self->delinearizeLength) {
-                free(rowcache);
-                return LJ92_ERROR_TOO_WIDE;
-            }
-            p = self->delinearize[p];
-        }
-        if (p>=maxval) {
-            free(rowcache);
-            return LJ92_ERROR_TOO_WIDE;
+// Bits of the difference that follow its huffman code. A category of 16 is always 32768.
+static inline int extraBits(int ssss) {
+    return ssss==16 ? 0 : ssss;
+}
+
+/* Store one difference as its SSSS category and the bits that follow the huffman code.
+ * Differences are taken modulo 2^16, so the category is at most 16.
+ */
+static inline void categorize(int32_t diff,uint16_t* residual,uint8_t* category) {
+    diff = ((diff + 32768) & 0xFFFF) - 32768;
+    int ssss = diff==0 ? 0 : 32 - __builtin_clz(abs(diff));
+    // Negative differences are sent as diff-1 in ssss bits
+    if (diff < 0)
+        diff += (1 << ssss)-1;
+    *residual = (uint32_t)diff & ((1u << extraBits(ssss))-1);
+    *category = ssss;
+}
+
+/* Predictor 1-7 for samples [from,to) of a row that has one above it. The
+ * left neighbour is step samples back, the same component of the previous
+ * pixel. It's an original sample, not a reconstructed one, so there is no
+ * dependency between columns and the vector versions do 4 or 8 at once.
+ */
+#define PREDICT_ROW(Px) \
+    for (int col=from;col<to;col++) { \
+        int left = cur[col-step], up = prev[col], upleft = prev[col-step]; \
+        (void)left; (void)up; (void)upleft; \
+        categorize(cur[col] - (Px),&residual[col],&ssss[col]); \
+    }
+LJ92_INLINE void predictRowScalar(int predictor,const uint16_t* cur,const uint16_t* prev,int step,uint16_t* residual,uint8_t* ssss,int from,int to) {
+    switch (predictor) {
+    case 1: PREDICT_ROW(left); break;
+    case 2: PREDICT_ROW(up); break;
+    case 3: PREDICT_ROW(upleft); break;
+    case 4: PREDICT_ROW(left + up - upleft); break;
+    case 5: PREDICT_ROW(left + ((up - upleft)>>1)); break;
+    case 6: PREDICT_ROW(up + ((left - upleft)>>1)); break;
+    case 7: PREDICT_ROW((left + up)>>1); break;
+    }
+}
+#undef PREDICT_ROW
+
+/* One kernel for each predictor out of a generic one, so the predictor is
+ * folded into the loop instead of switched on for every sample or vector.
+ */
+#define PREDICTOR_KERNELS(kernel,target) \
+    target static void kernel##1(PREDICT_ARGS) { kernel(1,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##2(PREDICT_ARGS) { kernel(2,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##3(PREDICT_ARGS) { kernel(3,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##4(PREDICT_ARGS) { kernel(4,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##5(PREDICT_ARGS) { kernel(5,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##6(PREDICT_ARGS) { kernel(6,cur,prev,step,residual,ssss,from,to); } \
+    target static void kernel##7(PREDICT_ARGS) { kernel(7,cur,prev,step,residual,ssss,from,to); } \
+    static const predictKernel kernel##Kernels[8] = { \
+        NULL,kernel##1,kernel##2,kernel##3,kernel##4,kernel##5,kernel##6,kernel##7 };
+#define PREDICT_ARGS const uint16_t* cur,const uint16_t* prev,int step,uint16_t* residual,uint8_t* ssss,int from,int to
+
+PREDICTOR_KERNELS(predictRowScalar,)
+
+static void histogramScalar(const uint8_t* ssss,int count,int* hist) {
+    // Four counters per category so runs of equal categories don't stall on one
+    int h4[4][17];
+    memset(h4,0,sizeof(h4));
+    int i = 0;
+    for (;i+4<=count;i+=4) {
+        h4[0][ssss[i]]++;
+        h4[1][ssss[i+1]]++;
+        h4[2][ssss[i+2]]++;
+        h4[3][ssss[i+3]]++;
+    }
+    for (;i<count;i++) {
+        h4[0][ssss[i]]++;
+    }
+    for (int h=0;h<17;h++) {
+        hist[h] += h4[0][h]+h4[1][h]+h4[2][h]+h4[3][h];
+    }
+}
+
+#ifdef LJ92_X86
+/* The category of |diff| is its bit length, which is the exponent of it as a
+ * float less 126, or 0 for 0. Turning the category back into a float exponent
+ * gives 1<<ssss for the mask. Differences are wrapped to 16 bits first, and
+ * nothing follows a category of 16.
+ */
+LJ92_TARGET("sse4.1")
+static inline __m128i predict4(int predictor,__m128i left,__m128i up,__m128i upleft) {
+    switch (predictor) {
+    case 1: return left;
+    case 2: return up;
+    case 3: return upleft;
+    case 4: return _mm_sub_epi32(_mm_add_epi32(left,up),upleft);
+    case 5: return _mm_add_epi32(left,_mm_srai_epi32(_mm_sub_epi32(up,upleft),1));
+    case 6: return _mm_add_epi32(up,_mm_srai_epi32(_mm_sub_epi32(left,upleft),1));
+    default: return _mm_srai_epi32(_mm_add_epi32(left,up),1);
+    }
+}
+
+LJ92_TARGET("sse4.1")
+LJ92_INLINE void predictRowSSE41(int predictor,const uint16_t* cur,const uint16_t* prev,int step,uint16_t* residual,uint8_t* ssss,int from,int to) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i sixteen = _mm_set1_epi32(16);
+    int col = from;
+    for (;col+4<=to;col+=4) {
+        __m128i x = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)&cur[col]));
+        __m128i left = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)&cur[col-step]));
+        __m128i up = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)&prev[col]));
+        __m128i upleft = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)&prev[col-step]));
+        __m128i diff = _mm_sub_epi32(x,predict4(predictor,left,up,upleft));
+        diff = _mm_srai_epi32(_mm_slli_epi32(diff,16),16);
+        __m128i exponent = _mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(_mm_abs_epi32(diff))),23);
+        __m128i s = _mm_max_epi32(_mm_sub_epi32(exponent,_mm_set1_epi32(126)),zero);
+        __m128i pow = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(s,_mm_set1_epi32(127)),23)));
+        __m128i r = _mm_and_si128(_mm_add_epi32(diff,_mm_srai_epi32(diff,31)),_mm_sub_epi32(pow,one));
+        r = _mm_andnot_si128(_mm_cmpeq_epi32(s,sixteen),r);
+        _mm_storel_epi64((__m128i*)&residual[col],_mm_packus_epi32(r,r));
+        __m128i s16 = _mm_packus_epi32(s,s);
+        int s8 = _mm_cvtsi128_si32(_mm_packus_epi16(s16,s16));
+        memcpy(&ssss[col],&s8,4);
+    }
+    predictRowScalar(predictor,cur,prev,step,residual,ssss,col,to);
+}
+PREDICTOR_KERNELS(predictRowSSE41,LJ92_TARGET("sse4.1"))
+
+LJ92_TARGET("avx2")
+static inline __m256i predict8(int predictor,__m256i left,__m256i up,__m256i upleft) {
+    switch (predictor) {
+    case 1: return left;
+    case 2: return up;
+    case 3: return upleft;
+    case 4: return _mm256_sub_epi32(_mm256_add_epi32(left,up),upleft);
+    case 5: return _mm256_add_epi32(left,_mm256_srai_epi32(_mm256_sub_epi32(up,upleft),1));
+    case 6: return _mm256_add_epi32(up,_mm256_srai_epi32(_mm256_sub_epi32(left,upleft),1));
+    default: return _mm256_srai_epi32(_mm256_add_epi32(left,up),1);
+    }
+}
+
+LJ92_TARGET("avx2")
+LJ92_INLINE void predictRowAVX2(int predictor,const uint16_t* cur,const uint16_t* prev,int step,uint16_t* residual,uint8_t* ssss,int from,int to) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i sixteen = _mm256_set1_epi32(16);
+    int col = from;
+    for (;col+8<=to;col+=8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&cur[col]));
+        __m256i left = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&cur[col-step]));
+        __m256i up = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&prev[col]));
+        __m256i upleft = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&prev[col-step]));
+        __m256i diff = _mm256_sub_epi32(x,predict8(predictor,left,up,upleft));
+        diff = _mm256_srai_epi32(_mm256_slli_epi32(diff,16),16);
+        __m256i exponent = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_abs_epi32(diff))),23);
+        __m256i s = _mm256_max_epi32(_mm256_sub_epi32(exponent,_mm256_set1_epi32(126)),zero);
+        __m256i mask = _mm256_sub_epi32(_mm256_sllv_epi32(one,s),one);
+        __m256i r = _mm256_and_si256(_mm256_add_epi32(diff,_mm256_srai_epi32(diff,31)),mask);
+        r = _mm256_andnot_si256(_mm256_cmpeq_epi32(s,sixteen),r);
+        _mm_storeu_si128((__m128i*)&residual[col],
+            _mm_packus_epi32(_mm256_castsi256_si128(r),_mm256_extracti128_si256(r,1)));
+        __m128i s16 = _mm_packus_epi32(_mm256_castsi256_si128(s),_mm256_extracti128_si256(s,1));
+        _mm_storel_epi64((__m128i*)&ssss[col],_mm_packus_epi16(s16,s16));
+    }
+    predictRowScalar(predictor,cur,prev,step,residual,ssss,col,to);
+}
+PREDICTOR_KERNELS(predictRowAVX2,LJ92_TARGET("avx2"))
+
+/* Count categories in blocks of at most 255 vectors, so per-byte counters
+ * can't overflow. Only the categories up to the block's largest are counted,
+ * and category 0 is whatever is left over.
+ */
+LJ92_TARGET("sse4.1")
+static void histogramSSE41(const uint8_t* ssss,int count,int* hist) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    while (i+16<=count) {
+        int vectors = (count-i)/16;
+        if (vectors > 255) vectors = 255;
+        const __m128i* v = (const __m128i*)&ssss[i];
+        __m128i top = zero;
+        for (int k=0;k<vectors;k++) top = _mm_max_epu8(top,_mm_loadu_si128(&v[k]));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,8));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,4));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,2));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,1));
+        int largest = _mm_cvtsi128_si32(top) & 0xff;
+        int counted = 0;
+        for (int h=1;h<=largest;h++) {
+            const __m128i category = _mm_set1_epi8((char)h);
+            __m128i acc = zero;
+            for (int k=0;k<vectors;k++)
+                acc = _mm_sub_epi8(acc,_mm_cmpeq_epi8(_mm_loadu_si128(&v[k]),category));
+            acc = _mm_sad_epu8(acc,zero);
+            int n = _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc,2);
+            hist[h] += n;
+            counted += n;
         }
-        rows[1][col] = p;
-
-        if ((row == 0)&&(col == 0))
-            Px = 1 << (self->bitdepth-1);
-        else if (row == 0)
-            Px = rows[1][col-1];
-        else if (col == 0)
-            Px = rows[0][col];
-        else
-            Px = rows[0][col] + ((rows[1][col-1] - rows[0][col-1])>>1);
-        diff = rows[1][col] - Px;
-        int ssss = 32 - __builtin_clz(abs(diff));
-        if (diff==0) ssss=0;
-        self->hist[ssss]++;
-        //printf("%d %d %d %d %d %d\n",col,row,p,Px,diff,ssss);
-        pixel++;
-        scan--;
-        col++;
-        if (scan==0) { pixel += self->skipLength; scan = self->readLength; }
-        if (col==self->width) {
-            uint16_t* tmprow = rows[1];
-            rows[1] = rows[0];
-            rows[0] = tmprow;
-            col=0;
-            row++;
+        hist[0] += vectors*16 - counted;
+        i += vectors*16;
+    }
+    histogramScalar(&ssss[i],count-i,hist);
+}
+
+LJ92_TARGET("avx2")
+static void histogramAVX2(const uint8_t* ssss,int count,int* hist) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    while (i+32<=count) {
+        int vectors = (count-i)/32;
+        if (vectors > 255) vectors = 255;
+        const __m256i* v = (const __m256i*)&ssss[i];
+        __m256i top256 = zero;
+        for (int k=0;k<vectors;k++) top256 = _mm256_max_epu8(top256,_mm256_loadu_si256(&v[k]));
+        __m128i top = _mm_max_epu8(_mm256_castsi256_si128(top256),_mm256_extracti128_si256(top256,1));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,8));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,4));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,2));
+        top = _mm_max_epu8(top,_mm_srli_si128(top,1));
+        int largest = _mm_cvtsi128_si32(top) & 0xff;
+        int counted = 0;
+        for (int h=1;h<=largest;h++) {
+            const __m256i category = _mm256_set1_epi8((char)h);
+            __m256i acc = zero;
+            for (int k=0;k<vectors;k++)
+                acc = _mm256_sub_epi8(acc,_mm256_cmpeq_epi8(_mm256_loadu_si256(&v[k]),category));
+            acc = _mm256_sad_epu8(acc,zero);
+            __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc),_mm256_extracti128_si256(acc,1));
+            int n = _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum,2);
+            hist[h] += n;
+            counted += n;
         }
+        hist[0] += vectors*32 - counted;
+        i += vectors*32;
     }
-#ifdef DEBUG
-    int sort[17];
-    for (int h=0;h<17;h++) {
-        sort[h] = h;
-        printf("%d:%d\n",h,self->hist[h]);
+    histogramScalar(&ssss[i],count-i,hist);
+}
+
+enum { CPU_SSE41 = 1, CPU_AVX2 = 2 };
+
+static int cpuFeatures(void) {
+    int features = 0;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info,0);
+    int leaves = info[0];
+    __cpuid(info,1);
+    if (info[2] & (1<<19)) features |= CPU_SSE41;
+    // AVX2 also needs the OS to save the upper halves of the registers
+    int osxsave = (info[2] & (1<<27)) != 0;
+    if (leaves >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info,7,0);
+        if (info[1] & (1<<5)) features |= CPU_AVX2;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) features |= CPU_SSE41;
+    if (__builtin_cpu_supports("avx2")) features |= CPU_AVX2;
+#endif
+    return features;
+}
+#endif
+
+static void selectKernels(lje* self) {
+    self->predictRow = predictRowScalarKernels;
+    self->histogram = histogramScalar;
+#ifdef LJ92_X86
+    int features = cpuFeatures();
+    if (features & CPU_AVX2) {
+        self->predictRow = predictRowAVX2Kernels;
+        self->histogram = histogramAVX2;
+    } else if (features & CPU_SSE41) {
+        self->predictRow = predictRowSSE41Kernels;
+        self->histogram = histogramSSE41;
     }
 #endif
-    free(rowcache);
-    return LJ92_ERROR_NONE;
 }
 
-void createEncodeTable(lje* self) {
-    float freq[18];
-    int codesize[18];
-    int others[18];
+/* Divide a sample by 2^pointTransform, rounding to nearest but staying
+ * within the bits that are left, so it comes back as close as it can when
+ * the decoder shifts it up again.
+ */
+static inline uint16_t transformSample(const lje* self,uint16_t p) {
+    int pt = self->pointTransform;
+    int q = (p + (1 << pt >> 1)) >> pt;
+    int top = (1 << (self->bitdepth - pt)) - 1;
+    return q > top ? top : q;
+}
 
-    // Calculate frequencies
-    float totalpixels = self->width * self->height;
-    for (int i=0;i<17;i++) {
-        freq[i] = (float)(self->hist[i])/totalpixels;
-#ifdef DEBUG
-        printf("%d:%f\n",i,freq[i]);
-#endif
-        codesize[i] = 0;
-        others[i] = -1;
+static void predictRowWith(lje* self,int predictor,const uint16_t* cur,const uint16_t* prev,uint16_t* residual,uint8_t* ssss) {
+    self->predictRow[predictor](cur,prev,self->components,residual,ssss,self->components,self->samples);
+}
+
+/* Read any one row of the image as predictScan would. Samples outside the
+ * delinearization table read as 0, predictScan is what rejects them.
+ */
+static void gatherRow(lje* self,int row,uint16_t* out) {
+    int64_t pos = (int64_t)row*self->samples;
+    uint16_t* pixel = &self->image[pos/self->readLength*(self->readLength+self->skipLength) + pos%self->readLength];
+    int scan = self->readLength - (int)(pos%self->readLength);
+    for (int col=0;col<self->samples;col++) {
+        uint16_t p = *pixel++;
+        if (self->delinearize) p = p<self->delinearizeLength ? self->delinearize[p] : 0;
+        if (self->pointTransform) p = transformSample(self,p);
+        out[col] = p;
+        if (--scan==0) { pixel += self->skipLength; scan = self->readLength; }
     }
-    codesize[17] = 0;
-    others[17] = -1;
-    freq[17] = 1.0f;
+}
+
+/* Copy the next row of samples into cur, delinearizing and transforming them
+ * if asked, and check they're in range. predictRows has one of these for each
+ * combination, so none of it is decided per sample.
+ */
+LJ92_INLINE int gatherSamples(lje* self,uint16_t** pixel,int* scan,uint16_t* cur,int delinearized,int transformed) {
+    uint16_t* p = *pixel;
+    int left = *scan;
+    int maxval = (1 << self->bitdepth);
+    for (int col=0;col<self->samples;col++) {
+        uint16_t v = *p++;
+        if (delinearized) {
+            if (v>=self->delinearizeLength) return LJ92_ERROR_TOO_WIDE;
+            v = self->delinearize[v];
+        }
+        if (v>=maxval) return LJ92_ERROR_TOO_WIDE;
+        if (transformed) v = transformSample(self,v);
+        cur[col] = v;
+        if (--left==0) { p += self->skipLength; left = self->readLength; }
+    }
+    *pixel = p;
+    *scan = left;
+    return LJ92_ERROR_NONE;
+}
 
-    float v1f,v2f;
-    int v1,v2;
+// gatherSamples for whichever of its cases this image is
+static int gatherRowSamples(lje* self,uint16_t** pixel,int* scan,uint16_t* cur) {
+    if (self->delinearize)
+        return self->pointTransform ? gatherSamples(self,pixel,scan,cur,1,1) : gatherSamples(self,pixel,scan,cur,1,0);
+    else
+        return self->pointTransform ? gatherSamples(self,pixel,scan,cur,0,1) : gatherSamples(self,pixel,scan,cur,0,0);
+}
 
-    while (1) {
-        v1f=3.0f;
-        v1=-1;
-        for (int i=0;i<18;i++) {
-            if ((freq[i]<=v1f) && (freq[i]>0.0f)) {
-                v1f = freq[i];
-                v1 = i;
+/* Predict one row from prev with predictRow, or as the first row of the
+ * image or of an interval when prev is NULL.
+ */
+LJ92_INLINE void predictOneRow(lje* self,predictKernel predictRow,const uint16_t* cur,const uint16_t* prev,
+                               uint16_t* residual,uint8_t* ssss) {
+    int width = self->samples;
+    int step = self->components;
+    // The first pixel of a row has nothing to its left
+    if (prev == NULL) {
+        for (int col=0;col<step;col++)
+            categorize(cur[col] - (1 << (self->bitdepth-self->pointTransform-1)),&residual[col],&ssss[col]);
+        for (int col=step;col<width;col++)
+            categorize(cur[col] - cur[col-step],&residual[col],&ssss[col]);
+    } else {
+        for (int col=0;col<step;col++)
+            categorize(cur[col] - prev[col],&residual[col],&ssss[col]);
+        predictRow(cur,prev,step,residual,ssss,step,width);
+    }
+}
+
+/* Predict a row that lies in memory as runs of run samples, stride apart, as
+ * predictOneRow would the same row in one piece. Each run is predicted where
+ * it lies. The first pixel of every run after the first has its neighbours on
+ * the left in the run before, so it's predicted from a copy of the two.
+ */
+static void predictRuns(lje* self,predictKernel predictRow,const uint16_t* cur,const uint16_t* prev,
+                        int run,int stride,uint16_t* residual,uint8_t* ssss) {
+    int width = self->samples;
+    int step = self->components;
+    if (run == width) {
+        predictOneRow(self,predictRow,cur,prev,residual,ssss);
+        return;
+    }
+    for (int start=0;start<width;start+=run) {
+        if (start == 0) {
+            for (int col=0;col<step;col++)
+                categorize(cur[col] - (prev ? prev[col] : 1 << (self->bitdepth-self->pointTransform-1)),
+                           &residual[col],&ssss[col]);
+        } else {
+            uint16_t joinCur[8], joinPrev[8];
+            for (int col=0;col<step;col++) {
+                joinCur[col] = cur[run-step-stride+col];
+                joinCur[step+col] = cur[col];
+                if (prev) {
+                    joinPrev[col] = prev[run-step-stride+col];
+                    joinPrev[step+col] = prev[col];
+                }
             }
+            if (prev)
+                predictRow(joinCur,joinPrev,step,residual+start-step,ssss+start-step,step,2*step);
+            else for (int col=0;col<step;col++)
+                categorize(joinCur[step+col] - joinCur[col],&residual[start+col],&ssss[start+col]);
         }
-#ifdef DEBUG
-        printf("v1:%d,%f\n",v1,v1f);
-#endif
-        v2f=3.0f;
-        v2=-1;
-        for (int i=0;i<18;i++) {
-            if (i==v1) continue;
-            if ((freq[i]<v2f) && (freq[i]>0.0f)) {
-                v2f = freq[i];
-                v2 = i;
+        if (prev)
+            predictRow(cur,prev,step,residual+start,ssss+start,step,run);
+        else for (int col=step;col<run;col++)
+            categorize(cur[col] - cur[col-step],&residual[start+col],&ssss[start+col]);
+        cur += stride;
+        if (prev) prev += stride;
+    }
+}
+
+/* Predict rows from to to, the first of them as the first row of the image,
+ * keeping the SSSS category of each difference and the bits that follow its
+ * huffman code. Both the histogram and the body are built from these, so the
+ * (strided) image is only read here. rowcache holds two rows.
+ */
+static int predictRows(lje* self,int from,int to,uint16_t* rowcache) {
+    // Rows are used in place when they can be, otherwise gathered into the row cache.
+    // In place, a row is one or more whole reads, such as the two sensor rows of a CFA
+    // read as two components. Either way, the previous row is kept for prediction because of tiling.
+    int width = self->samples;
+    int64_t pos = (int64_t)from*width;
+    uint16_t* pixel = &self->image[pos/self->readLength*(self->readLength+self->skipLength) + pos%self->readLength];
+    int scan = self->readLength - (int)(pos%self->readLength);
+    int run = self->skipLength==0 ? width : self->readLength;
+    int stride = run + self->skipLength;
+    int inPlace = self->delinearize==NULL && self->pointTransform==0 &&
+                  width%run==0 && run%self->components==0;
+    const uint16_t* prev = NULL;
+    // Chosen once, with the predictor folded in
+    predictKernel predictRow = self->predictRow[self->predictor];
+
+    for (int row=from;row<to;row++) {
+        uint16_t* cur;
+        if (inPlace) {
+            cur = pixel;
+            pixel += width/run*stride;
+            // Any sample with bits above bitdepth is out of range
+            uint32_t any = 0;
+            for (const uint16_t* read=cur;read<pixel;read+=stride)
+                for (int col=0;col<run;col++) any |= read[col];
+            if (any >> self->bitdepth) {
+                return LJ92_ERROR_TOO_WIDE;
             }
+            predictRuns(self,predictRow,cur,row == from ? NULL : prev,run,stride,
+                        &self->residual[(size_t)row*width],&self->ssss[(size_t)row*width]);
+        } else {
+            cur = &rowcache[(row&1)*width];
+            int ret = gatherRowSamples(self,&pixel,&scan,cur);
+            if (ret != LJ92_ERROR_NONE) return ret;
+            predictOneRow(self,predictRow,cur,row == from ? NULL : prev,
+                          &self->residual[(size_t)row*width],&self->ssss[(size_t)row*width]);
         }
-        if (v2==-1) break; // Done
+        prev = cur;
+    }
+    return LJ92_ERROR_NONE;
+}
 
-        freq[v1] += freq[v2];
-        freq[v2] = 0.0f;
+int predictScan(lje* self) {
+    return predictRows(self,0,self->height,self->rowcache);
+}
 
-        while (1) {
-            codesize[v1]++;
-            if (others[v1]==-1) break;
-            v1 = others[v1];
+void frequencyScan(lje* self) {
+    memset(self->hist,0,sizeof(self->hist));
+    self->histogram(self->ssss,self->samples*self->height,self->hist);
+#ifdef DEBUG
+    for (int h=0;h<17;h++) {
+        printf("%d:%d\n",h,self->hist[h]);
+    }
+#endif
+}
+
+/* Code lengths for the categories of hist, at most 16 bits each, taking the
+ * fewest bits in total (package-merge). Unused categories get no code.
+ * codesize[17] is the code of all ones, which JPEG reserves: it is made the
+ * lightest symbol so it always gets one of the longest codes, and with it
+ * the last one in the canonical order.
+ */
+static void huffmanSizes(const int* hist,int* codesize) {
+    enum { MAXBITS = 16, SYMBOLS = 18 };
+    int symbol[SYMBOLS];
+    int64_t weight[SYMBOLS];
+    int n = 0;
+    // Sort the symbols by weight, the reserved one first
+    for (int i=-1;i<17;i++) {
+        int s = i<0 ? 17 : i;
+        int64_t w = i<0 ? 0 : hist[i];
+        if (i>=0 && w<=0) continue;
+        int k = n++;
+        for (;k>0 && weight[k-1]>w;k--) {
+            symbol[k] = symbol[k-1];
+            weight[k] = weight[k-1];
         }
-        others[v1] = v2;
-        while (1) {
-            codesize[v2]++;
-            if (others[v2]==-1) break;
-            v2 = others[v2];
+        symbol[k] = s;
+        weight[k] = w;
+    }
+    memset(codesize,0,SYMBOLS*sizeof(int));
+    if (n < 2) return;
+
+    // One list per code length, from the longest up. Each is the symbols
+    // merged with pairs of items from the list below, with the symbol
+    // first on ties. An item is a symbol, or -1 for a pair.
+    int64_t listWeight[MAXBITS][2*SYMBOLS];
+    int listItem[MAXBITS][2*SYMBOLS];
+    int listLength[MAXBITS];
+    for (int level=MAXBITS-1;level>=0;level--) {
+        int pairs = level==MAXBITS-1 ? 0 : listLength[level+1]/2;
+        int m = 0, a = 0, b = 0;
+        while (a<n || b<pairs) {
+            int64_t pair = b<pairs ? listWeight[level+1][2*b]+listWeight[level+1][2*b+1] : 0;
+            if (b>=pairs || (a<n && weight[a]<=pair)) {
+                listWeight[level][m] = weight[a];
+                listItem[level][m++] = symbol[a++];
+            } else {
+                listWeight[level][m] = pair;
+                listItem[level][m++] = -1;
+                b++;
+            }
         }
+        listLength[level] = m;
     }
+    // The cheapest 2n-2 items of the top list make the code. Every symbol in
+    // them, directly or inside pairs, is one bit longer, and the pairs used
+    // at one length are always the first ones of the list below.
+    int take = 2*n-2;
+    for (int level=0;level<MAXBITS && take>0;level++) {
+        int pairs = 0;
+        for (int k=0;k<take;k++) {
+            if (listItem[level][k]<0) pairs++;
+            else codesize[listItem[level][k]]++;
+        }
+        take = 2*pairs;
+    }
+}
+
+void createEncodeTable(lje* self,const int* hist) {
+    int codesize[18];
+    huffmanSizes(hist,codesize);
+    // Codes of each length, not counting the reserved one
     int* bits = self->bits;
     memset(bits,0,sizeof(self->bits));
-    for (int i=0;i<18;i++) {
+    for (int i=0;i<17;i++) {
         if (codesize[i]!=0) {
             bits[codesize[i]]++;
         }
@@ -875,81 +1439,38 @@ void createEncodeTable(lje* self) {
         printf("bits:%d,%d,%d\n",i,bits[i],codesize[i]);
     }
 #endif
+    // Categories in the order the table lists them, shortest codes first
     int* huffval = self->huffval;
-    int i=1;
-    int k=0;
-    int j;
+    int k = 0;
     memset(huffval,0,sizeof(self->huffval));
-    while (i<=32) {
-        j=0;
-        while (j<17) {
-            if (codesize[j]==i) {
+    for (int len=1;len<=16;len++) {
+        for (int j=0;j<17;j++) {
+            if (codesize[j]==len) {
                 huffval[k++] = j;
             }
-            j++;
         }
-        i++;
-    }
-#ifdef DEBUG
-    for (i=0;i<17;i++) {
-        printf("i=%d,huffval[i]=%x\n",i,huffval[i]);
-    }
-#endif
-    int maxbits = 16;
-    while (maxbits>0) {
-        if (bits[maxbits]) break;
-        maxbits--;
     }
+    // Canonical codes, counting up within a length and doubling for the next
     u16* huffenc = self->huffenc;
     u16* huffbits = self->huffbits;
     int* huffsym = self->huffsym;
     memset(huffenc,0,sizeof(self->huffenc));
     memset(huffbits,0,sizeof(self->huffbits));
-    memset(self->huffsym,0,sizeof(self->huffsym));
-    i = 0;
-    int hv = 0;
-    int rv = 0;
-    int vl = 0; // i
-    //int hcode;
-    int bitsused = 1;
-    int sym = 0;
-    //printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-    while (i<1<<maxbits) {
-        if (bitsused>maxbits) {
-            break; // Done. Should never get here!
-        }
-        if (vl >= bits[bitsused]) {
-            bitsused++;
-            vl = 0;
-            continue;
-        }
-        if (rv == 1 << (maxbits-bitsused)) {
-            rv = 0;
-            vl++;
-            hv++;
-            //printf("%04x:%x:%d:%x\n",i,huffvals[hv],bitsused,1<<(maxbits-bitsused));
-            continue;
+    memset(huffsym,0,sizeof(self->huffsym));
+    int code = 0;
+    k = 0;
+    for (int len=1;len<=16;len++) {
+        for (int n=0;n<bits[len];n++) {
+            huffenc[k] = code++;
+            huffbits[k] = len;
+            huffsym[huffval[k]] = k;
+            k++;
         }
-        huffbits[sym] = bitsused;
-        huffenc[sym++] = i>>(maxbits-bitsused);
-        //printf("%d %d %d\n",i,bitsused,hcode);
-        i+= (1<<(maxbits-bitsused));
-        rv = 1<<(maxbits-bitsused);
+        code <<= 1;
     }
-    for (i=0;i<17;i++) {
-        if (huffbits[i]>0) {
-            huffsym[huffval[i]] = i;
-        }
 #ifdef DEBUG
+    for (int i=0;i<k;i++) {
         printf("huffval[%d]=%d,huffenc[%d]=%x,bits=%d\n",i,huffval[i],i,huffenc[i],huffbits[i]);
-#endif
-        if (huffbits[i]>0) {
-            huffsym[huffval[i]] = i;
-        }
-    }
-#ifdef DEBUG
-    for (i=0;i<17;i++) {
-        printf("huffsym[%d]=%d\n",i,huffsym[i]);
     }
 #endif
 }
@@ -960,14 +1481,16 @@ void writeHeader(lje* self) {
     e[w++] = 0xff; e[w++] = 0xd8; //SOI
     e[w++] = 0xff; e[w++] = 0xc3; //SOF3
         // Write SOF
-        e[w++] = 0x0; e[w++] = 11; //Lf, frame header length
+        e[w++] = 0x0; e[w++] = 8+3*self->components; //Lf, frame header length
         e[w++] = self->bitdepth;
         e[w++] = self->height>>8; e[w++] = self->height&0xFF;
         e[w++] = self->width>>8; e[w++] = self->width&0xFF;
-        e[w++] = 1; // Components
-        e[w++] = 0; // Component ID
-        e[w++] = 0x11; // Component X/Y
-        e[w++] = 0; // Unused (Quantisation)
+        e[w++] = self->components; // Components
+        for (int c=0;c<self->components;c++) {
+            e[w++] = c; // Component ID
+            e[w++] = 0x11; // Component X/Y
+            e[w++] = 0; // Unused (Quantisation)
+        }
     e[w++] = 0xff; e[w++] = 0xc4; //HUFF
     // Write HUFF
         int count = 0;
@@ -982,15 +1505,24 @@ void writeHeader(lje* self) {
         for (int i=0;i<count;i++) {
             e[w++] = self->huffval[i];
         }
+    if (self->intervalRows) {
+        // Every interval is whole rows of pixels
+        int interval = self->intervalRows*self->width;
+        e[w++] = 0xff; e[w++] = 0xdd; //DRI
+        e[w++] = 0x0; e[w++] = 4; //Lr
+        e[w++] = interval>>8; e[w++] = interval&0xFF;
+    }
     e[w++] = 0xff; e[w++] = 0xda; //SCAN
     // Write SCAN
-        e[w++] = 0x0; e[w++] = 8; //Ls, scan header length
-        e[w++] = 1; // Components
-        e[w++] = 0; //
-        e[w++] = 0; //
-        e[w++] = 6; // Predictor
-        e[w++] = 0; //
+        e[w++] = 0x0; e[w++] = 6+2*self->components; //Ls, scan header length
+        e[w++] = self->components; // Components
+        for (int c=0;c<self->components;c++) {
+            e[w++] = c; // Component ID
+            e[w++] = 0; // Huffman table, the same for all
+        }
+        e[w++] = self->predictor; // Predictor
         e[w++] = 0; //
+        e[w++] = self->pointTransform; // Ah=0, Al=point transform
     self->encodedWritten = w;
 }
 
@@ -1001,169 +1533,822 @@ void writePost(lje* self) {
     self->encodedWritten = w;
 }
 
-void writeBody(lje* self) {
-    // Scan through the tile using the standard type 6 prediction
-    // Need to cache the previous 2 row in target coordinates because of tiling
-    uint16_t* pixel = self->image;
-    int pixcount = self->width*self->height;
-    int scan = self->readLength;
-    uint16_t* rowcache = (uint16_t*)calloc(1,self->width*4);
-    uint16_t* rows[2];
-    rows[0] = rowcache;
-    rows[1] = &rowcache[self->width];
-
-    int col = 0;
-    int row = 0;
-    int Px = 0;
-    int32_t diff = 0;
-    int bitcount = 0;
-    uint8_t* out = self->encoded;
-    int w = self->encodedWritten;
-    uint8_t next = 0;
-    uint8_t nextbits = 8;
-    while (pixcount--) {
-        uint16_t p = *pixel;
-        if (self->delinearize) p = self->delinearize[p];
-        rows[1][col] = p;
-
-        if ((row == 0)&&(col == 0))
-            Px = 1 << (self->bitdepth-1);
-        else if (row == 0)
-            Px = rows[1][col-1];
-        else if (col == 0)
-            Px = rows[0][col];
-        else
-            Px = rows[0][col] + ((rows[1][col-1] - rows[0][col-1])>>1);
-        diff = rows[1][col] - Px;
-        int ssss = 32 - __builtin_clz(abs(diff));
-        if (diff==0) ssss=0;
-        //printf("%d %d %d %d %d\n",col,row,Px,diff,ssss);
-
-        // Write the huffman code for the ssss value
-        int huffcode = self->huffsym[ssss];
-        int huffenc = self->huffenc[huffcode];
-        int huffbits = self->huffbits[huffcode];
-        bitcount += huffbits + ssss;
-
-        int vt = ssss>0?(1<<(ssss-1)):0;
-        //printf("%d %d %d %d\n",rows[1][col],Px,diff,Px+diff);
-#ifdef DEBUG
-#endif
-        if (diff < vt)
-            diff += (1 << (ssss))-1;
-
-        // Write the ssss
-        while (huffbits>0) {
-            int usebits = huffbits>nextbits?nextbits:huffbits;
-            // Add top usebits from huffval to next usebits of nextbits
-            int tophuff = huffenc >> (huffbits - usebits);
-            next |= (tophuff << (nextbits-usebits));
-            nextbits -= usebits;
-            huffbits -= usebits;
-            huffenc &= (1<<huffbits)-1;
-            if (nextbits==0) {
-                out[w++] = next;
-                if (next==0xff) out[w++] = 0x0;
-                next = 0;
-                nextbits = 8;
-            }
-        }
-        // Write the rest of the bits for the value
-
-        while (ssss>0) {
-            int usebits = ssss>nextbits?nextbits:ssss;
-            // Add top usebits from huffval to next usebits of nextbits
-            int tophuff = diff >> (ssss - usebits);
-            next |= (tophuff << (nextbits-usebits));
-            nextbits -= usebits;
-            ssss -= usebits;
-            diff &= (1<<ssss)-1;
-            if (nextbits==0) {
-                out[w++] = next;
-                if (next==0xff) out[w++] = 0x0;
-                next = 0;
-                nextbits = 8;
-            }
-        }
+// The current table's codes, for writeCodes
+static void prepareCodes(lje* self,ljeCodes* codes) {
+    codes->longest = 0;
+    for (int ssss=0;ssss<17;ssss++) {
+        codes->huffenc[ssss] = self->huffenc[self->huffsym[ssss]];
+        codes->huffbits[ssss] = self->huffbits[self->huffsym[ssss]];
+        codes->extra[ssss] = extraBits(ssss);
+        if (codes->huffbits[ssss]+codes->extra[ssss] > codes->longest)
+            codes->longest = codes->huffbits[ssss]+codes->extra[ssss];
+    }
+}
 
-        //printf("%d %d\n",diff,ssss);
-        pixel++;
-        scan--;
-        col++;
-        if (scan==0) { pixel += self->skipLength; scan = self->readLength; }
-        if (col==self->width) {
-            uint16_t* tmprow = rows[1];
-            rows[1] = rows[0];
-            rows[0] = tmprow;
-            col=0;
-            row++;
+// Room a row of width samples might take. Stuffing can double it, and a word may be pending from the last one.
+static int64_t rowBound(int width,const ljeCodes* codes) {
+    return ((int64_t)width*codes->longest+7)/8*2+16;
+}
+
+// Codes for one row of predicted samples
+LJ92_INLINE void writeCodes(bitWriter* bw,const ljeCodes* codes,const uint16_t* residual,const uint8_t* category,int width) {
+    for (int col=0;col<width;col++) {
+        int ssss = category[col];
+        // The huffman code for ssss followed by ssss bits of the value
+        writeBits(bw,(codes->huffenc[ssss] << codes->extra[ssss]) | residual[col],codes->huffbits[ssss] + codes->extra[ssss]);
+    }
+}
+
+/* Codes for rows from to to, written from w on and padded to a whole byte.
+ * Returns where they end. When checkSpace is set, the output wasn't sized
+ * from this image's histogram, so the target is grown before any row that
+ * might not fit in what's left.
+ */
+static int writeRows(lje* self,int from,int to,int w,int checkSpace) {
+    // Everything was predicted by predictScan, so this only has to emit codes
+    int width = self->samples;
+    uint16_t* residual = &self->residual[(size_t)from*width];
+    uint8_t* category = &self->ssss[(size_t)from*width];
+    bitWriter bw = { 0, 0, self->encoded, w };
+    ljeCodes codes;
+    prepareCodes(self,&codes);
+    int64_t rowWorst = rowBound(width,&codes);
+    for (int row=from;row<to;row++) {
+        if (checkSpace && self->encodedLength - bw.w < rowWorst) {
+            int64_t length = (int64_t)self->encodedLength*3/2 + rowWorst;
+            if (length > INT32_MAX) return LJ92_ERROR_NO_MEMORY;
+            uint8_t* grown = (uint8_t*)realloc(*self->target,(size_t)length);
+            if (grown==NULL) return LJ92_ERROR_NO_MEMORY;
+            *self->target = self->encoded = bw.out = grown;
+            *self->targetLength = self->encodedLength = (int)length;
         }
+        writeCodes(&bw,&codes,residual,category,width);
+        residual += width;
+        category += width;
     }
     // Flush the final bits
-    if (nextbits<8) {
-        out[w++] = next;
-        if (next==0xff) out[w++] = 0x0;
+    flushBits(&bw);
+    return bw.w;
+}
+
+/* Body of the scan, without restart intervals */
+int writeBody(lje* self,int checkSpace) {
+    int w = writeRows(self,0,self->height,self->encodedWritten,checkSpace);
+    if (w < 0) return w;
+    self->encodedWritten = w;
+    return LJ92_ERROR_NONE;
+}
+
+/* Upper bound on the size of the codes for a histogram with the table just built.
+ * Every byte could need 0xFF stuffing, so allow for twice the bits.
+ */
+static int64_t bodyBound(lje* self,const int* hist) {
+    int64_t bits = 0;
+    for (int ssss=0;ssss<17;ssss++) {
+        bits += (int64_t)hist[ssss]*(self->huffbits[self->huffsym[ssss]]+extraBits(ssss));
     }
-#ifdef DEBUG
-    int sort[17];
-    for (int h=0;h<17;h++) {
-        sort[h] = h;
-        printf("%d:%d\n",h,self->hist[h]);
+    return ((bits+7)>>3)*2;
+}
+
+// Upper bound on the encoded size, with room for the headers
+static int64_t encodedBound(lje* self) {
+    return bodyBound(self,self->hist)+200;
+}
+
+static void predictInterval(void* arg,int index) {
+    lje* self = arg;
+    ljeInterval* interval = &self->intervals[index];
+    uint16_t* rowcache = &self->rowcache[(size_t)index*2*self->samples];
+    memset(interval->hist,0,sizeof(interval->hist));
+    interval->ret = predictRows(self,interval->from,interval->to,rowcache);
+    if (interval->ret == LJ92_ERROR_NONE)
+        self->histogram(&self->ssss[(size_t)interval->from*self->samples],
+                        (interval->to-interval->from)*self->samples,interval->hist);
+}
+
+static void writeInterval(void* arg,int index) {
+    lje* self = arg;
+    ljeInterval* interval = &self->intervals[index];
+    interval->end = writeRows(self,interval->from,interval->to,interval->start,0);
+}
+
+/* Split the image into restart intervals of self->restartRows, as far as the
+ * 16-bit interval in DRI allows. Returns how many, or 0 if it's all one.
+ */
+static int planIntervals(lje* self) {
+    self->intervalRows = 0;
+    if (self->restartRows <= 0) return 0;
+    int rows = self->restartRows;
+    if (rows > 65535/self->width) rows = 65535/self->width;
+    if (rows < 1 || rows >= self->height) return 0;
+    int count = (self->height + rows - 1)/rows;
+    if (self->intervalsLength < count) {
+        ljeInterval* intervals = (ljeInterval*)realloc(self->intervals,count*sizeof(ljeInterval));
+        if (intervals==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->intervals = intervals;
+        self->intervalsLength = count;
+    }
+    if (self->rowcacheLength < count*2*self->samples) {
+        uint16_t* rowcache = (uint16_t*)realloc(self->rowcache,(size_t)count*2*self->samples*sizeof(uint16_t));
+        if (rowcache==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->rowcache = rowcache;
+        self->rowcacheLength = count*2*self->samples;
+    }
+    for (int i=0;i<count;i++) {
+        self->intervals[i].from = i*rows;
+        self->intervals[i].to = i<count-1 ? (i+1)*rows : self->height;
+    }
+    self->intervalRows = rows;
+    return count;
+}
+
+/* Predict every interval at once, and total up their histograms */
+static int predictIntervals(lje* self,int count) {
+    lj92_parallel run = self->parallel ? self->parallel : runSerially;
+    run(self->parallelContext,count,predictInterval,self);
+    memset(self->hist,0,sizeof(self->hist));
+    for (int i=0;i<count;i++) {
+        if (self->intervals[i].ret != LJ92_ERROR_NONE) return self->intervals[i].ret;
+        for (int ssss=0;ssss<17;ssss++) self->hist[ssss] += self->intervals[i].hist[ssss];
+    }
+    return LJ92_ERROR_NONE;
+}
+
+// Room for the headers, then every interval with its own bound and a marker
+static int64_t intervalsBound(lje* self,int count) {
+    int64_t bound = 200;
+    for (int i=0;i<count;i++) bound += bodyBound(self,self->intervals[i].hist)+2;
+    return bound;
+}
+
+/* Write every interval at once, each at the start of the room its bound
+ * leaves it, then close the gaps with an RSTn marker between each.
+ */
+static void writeIntervals(lje* self,int count) {
+    int w = self->encodedWritten;
+    for (int i=0;i<count;i++) {
+        self->intervals[i].start = w;
+        w += (int)bodyBound(self,self->intervals[i].hist)+2;
+    }
+    lj92_parallel run = self->parallel ? self->parallel : runSerially;
+    run(self->parallelContext,count,writeInterval,self);
+    uint8_t* e = self->encoded;
+    w = self->encodedWritten;
+    for (int i=0;i<count;i++) {
+        ljeInterval* interval = &self->intervals[i];
+        memmove(&e[w],&e[interval->start],interval->end-interval->start);
+        w += interval->end-interval->start;
+        if (i<count-1) {
+            e[w++] = 0xff; e[w++] = 0xd0+(i&7); //RSTn
+        }
     }
-    printf("Total bytes: %d\n",bitcount>>3);
-#endif
-    free(rowcache);
     self->encodedWritten = w;
 }
-/* Encoder
- * Read tile from an image and encode in one shot
- * Return the encoded data
+
+/* Bits the current table spends on a histogram, and what a table built for
+ * that histogram would.
  */
-int lj92_encode(uint16_t* image, int width, int height, int bitdepth,
-                int readLength, int skipLength,
-                uint16_t* delinearize,int delinearizeLength,
-                uint8_t** encoded, int* encodedLength) {
-    int ret = LJ92_ERROR_NONE;
+static double tableCost(lje* self,const int* hist,double* fresh) {
+    int codesize[18];
+    double bits = 0, ideal = 0;
+    huffmanSizes(hist,codesize);
+    for (int ssss=0;ssss<17;ssss++) {
+        bits += (double)hist[ssss]*(self->huffbits[self->huffsym[ssss]]+extraBits(ssss));
+        ideal += (double)hist[ssss]*(codesize[ssss]+extraBits(ssss));
+    }
+    *fresh = ideal;
+    return bits;
+}
+
+// Bits a table built for this histogram would spend on it
+static double freshCost(const int* hist) {
+    int codesize[18];
+    double bits = 0;
+    huffmanSizes(hist,codesize);
+    for (int ssss=0;ssss<17;ssss++)
+        bits += (double)hist[ssss]*(codesize[ssss]+extraBits(ssss));
+    return bits;
+}
+
+// Add the categories each predictor would give one row, predicted from prev, to its histogram
+static void tallyPredictors(lje* self,const uint16_t* cur,const uint16_t* prev,int hist[7][17]) {
+    // Nothing else is in the residual buffers yet
+    uint16_t* residual = self->residual;
+    uint8_t* ssss = self->ssss;
+    int step = self->components;
+    for (int predictor=1;predictor<=7;predictor++) {
+        predictRowWith(self,predictor,cur,prev,residual,ssss);
+        self->histogram(&ssss[step],self->samples-step,hist[predictor-1]);
+    }
+}
+
+// The predictor whose categories a table made for them would take the fewest bits on. Ties go to predictor 6.
+static int bestPredictor(int hist[7][17]) {
+    int best = 6;
+    double bestBits = freshCost(hist[best-1]);
+    for (int predictor=1;predictor<=7;predictor++) {
+        double bits = freshCost(hist[predictor-1]);
+        if (bits < bestBits) {
+            best = predictor;
+            bestBits = bits;
+        }
+    }
+    return best;
+}
+
+/* Pick the predictor that costs the fewest bits on every 8th row, each row
+ * predicted from the one before it.
+ */
+static int choosePredictor(lje* self) {
+    int hist[7][17];
+    memset(hist,0,sizeof(hist));
+    uint16_t* prev = self->rowcache;
+    uint16_t* cur = &self->rowcache[self->samples];
+    for (int row=1;row<self->height;row+=8) {
+        gatherRow(self,row-1,prev);
+        gatherRow(self,row,cur);
+        tallyPredictors(self,cur,prev,hist);
+    }
+    return bestPredictor(hist);
+}
+
+/* Build a table from the images trained on so far, that can encode any
+ * category. Categories that haven't been seen count as seen once.
+ */
+static void trainTable(lje* self) {
+    int weighted[17];
+    for (int ssss=0;ssss<17;ssss++) {
+        self->trainHist[ssss] += self->hist[ssss];
+        weighted[ssss] = self->trainHist[ssss] > 0 ? self->trainHist[ssss] : 1;
+    }
+    createEncodeTable(self,weighted);
+    self->trainedPredictor = self->predictor;
+    double fresh;
+    double bits = tableCost(self,self->trainHist,&fresh);
+    self->trainedRatio = fresh > 0 ? bits/fresh : 1.0f;
+    self->trained++;
+}
+
+// Whether the table costs noticeably more on hist, of sampled samples, than it did on what it was built from
+static int histDrifted(lje* self,const int* hist,int64_t sampled) {
+    double fresh;
+    double bits = tableCost(self,hist,&fresh);
+    // Allow 2% and a 64th of a bit per pixel, so small samples don't trip it
+    return bits > fresh*self->trainedRatio*1.02 + sampled/64.0;
+}
+
+/* Check whether the table still suits this image from every 16th row of it.
+ * What the table costs over what a table of the sample's own would cost is
+ * compared with the same ratio on the images it was built from.
+ */
+static int tableDrifted(lje* self) {
+    int hist[17];
+    memset(hist,0,sizeof(hist));
+    int sampled = 0;
+    for (int row=0;row<self->height;row+=16) {
+        self->histogram(&self->ssss[row*self->samples],self->samples,hist);
+        sampled += self->samples;
+    }
+    return histDrifted(self,hist,sampled);
+}
+
+void lj92_encoder_set_predictor(lj92_encoder encoder,int predictor) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->predictorChoice = predictor>=0 && predictor<=7 ? predictor : 6;
+}
+
+int lj92_encoder_predictor(lj92_encoder encoder) {
+    lje* self = encoder;
+    if (self==NULL) return LJ92_ERROR_BAD_HANDLE;
+    return self->predictor;
+}
+
+void lj92_encoder_set_point_transform(lj92_encoder encoder,int pt) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->pointTransform = pt>0 && pt<16 ? pt : 0;
+}
+
+void lj92_encoder_set_limit(lj92_encoder encoder,int maxLength) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->limit = maxLength > 0 ? maxLength : 0;
+}
+
+void lj92_encoder_set_restart(lj92_encoder encoder,int rows) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->restartRows = rows > 0 ? rows : 0;
+}
+
+void lj92_encoder_set_parallel(lj92_encoder encoder,lj92_parallel run,void* context) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->parallel = run;
+    self->parallelContext = context;
+}
+
+void lj92_encoder_reuse_table(lj92_encoder encoder,int trainImages) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    self->trainImages = trainImages > 0 ? trainImages : 0;
+    self->trained = 0;
+    memset(self->trainHist,0,sizeof(self->trainHist));
+}
 
+int lj92_encoder_create(lj92_encoder* encoder) {
     lje* self = (lje*)calloc(sizeof(lje),1);
     if (self==NULL) return LJ92_ERROR_NO_MEMORY;
+    self->predictorChoice = 6;
+    selectKernels(self);
+    *encoder = self;
+    return LJ92_ERROR_NONE;
+}
+
+void lj92_encoder_destroy(lj92_encoder encoder) {
+    lje* self = encoder;
+    if (self==NULL) return;
+    free(self->rowcache);
+    free(self->residual);
+    free(self->ssss);
+    free(self->buffer);
+    free(self->intervals);
+    free(self);
+}
+
+// Bytes the codes for hist take with these code lengths, padded to a whole byte but not stuffed
+static int64_t bodyBytes(const int* hist,const int* codesize) {
+    int64_t bits = 0;
+    for (int ssss=0;ssss<17;ssss++)
+        bits += (int64_t)hist[ssss]*(codesize[ssss]+extraBits(ssss));
+    return (bits+7)>>3;
+}
+
+// Code lengths of the current table by category, as huffmanSizes gives them
+static void tableCodeSizes(lje* self,int* codesize) {
+    for (int ssss=0;ssss<17;ssss++)
+        codesize[ssss] = self->huffval[self->huffsym[ssss]]==ssss ? self->huffbits[self->huffsym[ssss]] : 0;
+    codesize[17] = 0;
+}
+
+/* Length of the stream for the image just predicted and its histogram, or its
+ * intervals', if each category takes codesize bits, short of any stuffing.
+ */
+static int64_t streamLength(lje* self,int intervals,const int* codesize) {
+    int codes = 0;
+    for (int ssss=0;ssss<17;ssss++)
+        if (codesize[ssss]) codes++;
+    // SOI, SOF3, DHT, SOS and EOI as writeHeader and writePost lay them out
+    int64_t length = 2 + (2+8+3*self->components) + (2+19+codes) + (2+6+2*self->components) + 2;
+    if (intervals) {
+        // DRI, and an RSTn between each interval
+        length += 6 + 2*(intervals-1);
+        for (int i=0;i<intervals;i++) length += bodyBytes(self->intervals[i].hist,codesize);
+    } else
+        length += bodyBytes(self->hist,codesize);
+    return length;
+}
+
+/* Take on the next image to encode, growing the scratch space for it, and
+ * choose its predictor.
+ */
+static int startImage(lje* self,
+                      uint16_t* image, int width, int height, int bitdepth, int components,
+                      int readLength, int skipLength,
+                      uint16_t* delinearize,int delinearizeLength) {
+    if (components<1 || components>4) return LJ92_ERROR_TOO_WIDE;
+    if (self->pointTransform >= bitdepth) return LJ92_ERROR_TOO_WIDE;
     self->image = image;
     self->width = width;
     self->height = height;
     self->bitdepth = bitdepth;
+    self->components = components;
+    self->samples = width*components;
+    width = self->samples;
     self->readLength = readLength;
     self->skipLength = skipLength;
     self->delinearize = delinearize;
     self->delinearizeLength = delinearizeLength;
-    self->encodedLength = width*height*3+200;
-    self->encoded = malloc(self->encodedLength);
-    if (self->encoded==NULL) { free(self); return LJ92_ERROR_NO_MEMORY; }
-    // Scan through data to gather frequencies of ssss prefixes
-    ret = frequencyScan(self);
-    if (ret != LJ92_ERROR_NONE) {
-        free(self->encoded);
-        free(self);
-        return ret;
+    if (self->rowcacheLength < width*2) {
+        uint16_t* rowcache = (uint16_t*)realloc(self->rowcache,width*4);
+        if (rowcache==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->rowcache = rowcache;
+        self->rowcacheLength = width*2;
+    }
+    if (self->residualLength < width*height) {
+        uint16_t* residual = (uint16_t*)realloc(self->residual,(size_t)width*height*sizeof(uint16_t));
+        if (residual==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->residual = residual;
+        uint8_t* ssss = (uint8_t*)realloc(self->ssss,(size_t)width*height);
+        if (ssss==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->ssss = ssss;
+        self->residualLength = width*height;
+    }
+    // Every pixel is predicted once, with the predictor asked for or the one that suits the image
+    self->predictor = self->predictorChoice ? self->predictorChoice : choosePredictor(self);
+    return LJ92_ERROR_NONE;
+}
+
+int lj92_encoder_encode_to(lj92_encoder encoder,
+                           uint16_t* image, int width, int height, int bitdepth, int components,
+                           int readLength, int skipLength,
+                           uint16_t* delinearize,int delinearizeLength,
+                           uint8_t** target, int* targetLength, int* encodedLength) {
+    lje* self = encoder;
+    if (self==NULL) return LJ92_ERROR_BAD_HANDLE;
+    int ret = startImage(self,image,width,height,bitdepth,components,readLength,skipLength,delinearize,delinearizeLength);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    width = self->samples;
+    self->encodedWritten = 0;
+    self->target = target;
+    self->targetLength = targetLength;
+    int intervals = planIntervals(self);
+    if (intervals < 0) return intervals;
+    // Restart intervals are predicted separately, and their histograms come for free
+    ret = intervals ? predictIntervals(self,intervals) : predictScan(self);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    int64_t bound;
+    // A table only suits the residuals of the predictor it was built for
+    int reusing = self->trainImages && self->trained >= self->trainImages &&
+                  self->predictor == self->trainedPredictor && !tableDrifted(self);
+    if (reusing && self->limit) {
+        // The frequencies are needed for the length after all, and size the output exactly
+        if (!intervals) frequencyScan(self);
+        bound = encodedBound(self);
+    } else if (reusing) {
+        // Skip the frequency pass. The output starts at the size of the input and grows if need be.
+        bound = (int64_t)width*height*2+200;
+    } else {
+        // Gather frequencies of ssss prefixes
+        if (!intervals) frequencyScan(self);
+        // Create encoded table based on frequencies
+        if (self->trainImages) {
+            if (self->trained >= self->trainImages || self->predictor != self->trainedPredictor) {
+                // Start over from this image
+                self->trained = 0;
+                memset(self->trainHist,0,sizeof(self->trainHist));
+            }
+            trainTable(self);
+        } else
+            createEncodeTable(self,self->hist);
+        // Make sure the worst case fits before writing anything
+        bound = encodedBound(self);
+    }
+    // Give up before writing anything, or growing the output, if the stream would be too long
+    if (self->limit) {
+        int codesize[18];
+        tableCodeSizes(self,codesize);
+        int64_t length = streamLength(self,intervals,codesize);
+        if (length > self->limit) {
+            *encodedLength = length > INT32_MAX ? INT32_MAX : (int)length;
+            return LJ92_ERROR_NO_GAIN;
+        }
     }
-    // Create encoded table based on frequencies
-    createEncodeTable(self);
+    // Intervals are written where their own bounds leave room, so never need to grow
+    if (intervals) bound = intervalsBound(self,intervals);
+    if (bound > INT32_MAX) return LJ92_ERROR_NO_MEMORY;
+    if (*targetLength < bound) {
+        uint8_t* grown = (uint8_t*)realloc(*target,(size_t)bound);
+        if (grown==NULL) return LJ92_ERROR_NO_MEMORY;
+        *target = grown;
+        *targetLength = (int)bound;
+    }
+    self->encoded = *target;
+    self->encodedLength = *targetLength;
     // Write JPEG head and scan header
     writeHeader(self);
     // Scan through and do the compression
-    writeBody(self);
+    if (intervals)
+        writeIntervals(self,intervals);
+    else {
+        ret = writeBody(self,reusing);
+        if (ret != LJ92_ERROR_NONE) return ret;
+    }
     // Finish
     writePost(self);
 #ifdef DEBUG
     printf("written:%d\n",self->encodedWritten);
 #endif
-    self->encoded = realloc(self->encoded,self->encodedWritten);
-    self->encodedLength = self->encodedWritten;
-    *encoded = self->encoded;
-    *encodedLength = self->encodedLength;
+    *encodedLength = self->encodedWritten;
+    return LJ92_ERROR_NONE;
+}
 
-    free(self);
+int lj92_encoder_encode(lj92_encoder encoder,
+                        uint16_t* image, int width, int height, int bitdepth, int components,
+                        int readLength, int skipLength,
+                        uint16_t* delinearize,int delinearizeLength,
+                        uint8_t** encoded, int* encodedLength) {
+    lje* self = encoder;
+    if (self==NULL) return LJ92_ERROR_BAD_HANDLE;
+    int ret = lj92_encoder_encode_to(encoder,image,width,height,bitdepth,components,
+                                     readLength,skipLength,delinearize,delinearizeLength,
+                                     &self->buffer,&self->bufferLength,encodedLength);
+    if (ret == LJ92_ERROR_NONE) *encoded = self->buffer;
+    return ret;
+}
+
+/* Predict every rowStep-th row from the one above it, checking both are in
+ * range, and scale their histogram up to the whole image. With restart
+ * intervals each gets its share by rows, for streamLength.
+ */
+static int predictSampledRows(lje* self,int rowStep,int intervals) {
+    uint16_t* prev = self->rowcache;
+    uint16_t* cur = &self->rowcache[self->samples];
+    int hist[17];
+    memset(hist,0,sizeof(hist));
+    int sampled = 0;
+    for (int row=1;row<self->height;row+=rowStep) {
+        int64_t pos = (int64_t)(row-1)*self->samples;
+        uint16_t* pixel = &self->image[pos/self->readLength*(self->readLength+self->skipLength) + pos%self->readLength];
+        int scan = self->readLength - (int)(pos%self->readLength);
+        int ret = gatherRowSamples(self,&pixel,&scan,prev);
+        if (ret == LJ92_ERROR_NONE) ret = gatherRowSamples(self,&pixel,&scan,cur);
+        if (ret != LJ92_ERROR_NONE) return ret;
+        predictOneRow(self,self->predictRow[self->predictor],cur,prev,self->residual,self->ssss);
+        self->histogram(self->ssss,self->samples,hist);
+        sampled++;
+    }
+    for (int ssss=0;ssss<17;ssss++)
+        self->hist[ssss] = (int)((int64_t)hist[ssss]*self->height/sampled);
+    for (int i=0;i<intervals;i++) {
+        ljeInterval* interval = &self->intervals[i];
+        for (int ssss=0;ssss<17;ssss++)
+            interval->hist[ssss] = (int)((int64_t)hist[ssss]*(interval->to-interval->from)/sampled);
+    }
+    return LJ92_ERROR_NONE;
+}
+
+int lj92_encoder_estimate(lj92_encoder encoder,
+                          uint16_t* image, int width, int height, int bitdepth, int components,
+                          int readLength, int skipLength,
+                          uint16_t* delinearize,int delinearizeLength,
+                          int rowStep, int* encodedLength) {
+    lje* self = encoder;
+    if (self==NULL) return LJ92_ERROR_BAD_HANDLE;
+    int ret = startImage(self,image,width,height,bitdepth,components,readLength,skipLength,delinearize,delinearizeLength);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    int intervals = planIntervals(self);
+    if (intervals < 0) return intervals;
+    if (rowStep > 1 && rowStep < height)
+        ret = predictSampledRows(self,rowStep,intervals);
+    else {
+        ret = intervals ? predictIntervals(self,intervals) : predictScan(self);
+        if (ret == LJ92_ERROR_NONE && !intervals) frequencyScan(self);
+    }
+    if (ret != LJ92_ERROR_NONE) return ret;
+    // The code lengths encoding would give this image, leaving the table kept for reuse alone
+    int codesize[18];
+    huffmanSizes(self->hist,codesize);
+    int64_t length = streamLength(self,intervals,codesize);
+    if (length > INT32_MAX) return LJ92_ERROR_NO_MEMORY;
+    *encodedLength = (int)length;
+    return LJ92_ERROR_NONE;
+}
+
+/* Streaming: rows come in a few at a time and the stream leaves through the
+ * sink as it's written, so only a handful of rows are ever held.
+ */
 
+// Hand the sink everything in the buffer
+static int sinkStream(lje* self) {
+    if (self->stream.w == 0) return LJ92_ERROR_NONE;
+    if (self->sink(self->sinkContext,self->stream.out,self->stream.w) != 0) return LJ92_ERROR_SINK;
+    self->sunk += self->stream.w;
+    self->stream.w = 0;
+    return LJ92_ERROR_NONE;
+}
+
+// Write the header for the current table and get ready to write rows after it
+static int openStream(lje* self) {
+    prepareCodes(self,&self->codes);
+    self->rowWorst = rowBound(self->samples,&self->codes);
+    // Room for the headers and a few rows, so the sink gets them a few at a time
+    int64_t length = 200 + self->rowWorst*4;
+    if (length > INT32_MAX) return LJ92_ERROR_NO_MEMORY;
+    if (self->bufferLength < length) {
+        uint8_t* grown = (uint8_t*)realloc(self->buffer,(size_t)length);
+        if (grown==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->buffer = grown;
+        self->bufferLength = (int)length;
+    }
+    self->encoded = self->buffer;
+    self->encodedLength = self->bufferLength;
+    self->encodedWritten = 0;
+    writeHeader(self);
+    bitWriter bw = { 0, 0, self->buffer, self->encodedWritten };
+    self->stream = bw;
+    return LJ92_ERROR_NONE;
+}
+
+// Write the codes of one predicted row, making room in the buffer first if it might not fit
+static int writeStreamRow(lje* self,const uint16_t* residual,const uint8_t* ssss) {
+    if (self->bufferLength - self->stream.w < self->rowWorst) {
+        int ret = sinkStream(self);
+        if (ret != LJ92_ERROR_NONE) return ret;
+    }
+    // Local copies, so the compiler knows the output doesn't overwrite them
+    bitWriter bw = self->stream;
+    ljeCodes codes = self->codes;
+    writeCodes(&bw,&codes,residual,ssss,self->samples);
+    self->stream = bw;
+    return LJ92_ERROR_NONE;
+}
+
+/* The rows held back are all in: choose the predictor from them if need be,
+ * build the table, and write the header and the rows.
+ */
+static int startStream(lje* self) {
+    int rows = self->pushed;
+    int width = self->samples;
+    const uint16_t* rowcache = self->rowcache;
+    if (self->predictor == 0) {
+        int hist[7][17];
+        memset(hist,0,sizeof(hist));
+        for (int row=1;row<rows;row++)
+            tallyPredictors(self,&rowcache[row*width],&rowcache[(row-1)*width],hist);
+        self->predictor = bestPredictor(hist);
+    }
+    predictKernel predictRow = self->predictRow[self->predictor];
+    for (int row=0;row<rows;row++)
+        predictOneRow(self,predictRow,&rowcache[row*width],row ? &rowcache[(row-1)*width] : NULL,
+                      &self->residual[(size_t)row*width],&self->ssss[(size_t)row*width]);
+    self->histogram(self->ssss,rows*width,self->hist);
+    // Rows further down may have categories these don't, so every one gets a code
+    int weighted[17];
+    for (int ssss=0;ssss<17;ssss++)
+        weighted[ssss] = self->hist[ssss] > 0 ? self->hist[ssss] : 1;
+    createEncodeTable(self,weighted);
+    int ret = openStream(self);
+    for (int row=0;row<rows && ret == LJ92_ERROR_NONE;row++)
+        ret = writeStreamRow(self,&self->residual[(size_t)row*width],&self->ssss[(size_t)row*width]);
+    self->prevRow = &rowcache[(rows-1)*width];
+    self->lookahead = 0;
     return ret;
 }
 
+int lj92_encoder_begin(lj92_encoder encoder,
+                       int width, int height, int bitdepth, int components,
+                       uint16_t* delinearize,int delinearizeLength,
+                       int lookahead, lj92_sink sink, void* context) {
+    lje* self = encoder;
+    if (self==NULL || sink==NULL) return LJ92_ERROR_BAD_HANDLE;
+    if (components<1 || components>4 || width<1 || height<1) return LJ92_ERROR_TOO_WIDE;
+    if (self->pointTransform >= bitdepth) return LJ92_ERROR_TOO_WIDE;
+    self->streaming = 0;
+    self->image = NULL;
+    self->width = width;
+    self->height = height;
+    self->bitdepth = bitdepth;
+    self->components = components;
+    self->samples = width*components;
+    width = self->samples;
+    self->delinearize = delinearize;
+    self->delinearizeLength = delinearizeLength;
+    self->intervalRows = 0;
+    self->sink = sink;
+    self->sinkContext = context;
+    self->pushed = 0;
+    self->sunk = 0;
+    self->prevRow = NULL;
+    memset(self->hist,0,sizeof(self->hist));
+    // A finished table is used as it is, and a fixed predictor has to match it
+    self->streamReused = self->trainImages && self->trained >= self->trainImages &&
+                         (self->predictorChoice == 0 || self->predictorChoice == self->trainedPredictor);
+    if (self->streamReused) {
+        lookahead = 0;
+        self->predictor = self->trainedPredictor;
+    } else {
+        if (lookahead < 1) lookahead = 1;
+        if (lookahead > height) lookahead = height;
+        self->predictor = self->predictorChoice;
+    }
+    self->lookahead = lookahead;
+    // The rows held back, or the two the stream alternates between once it's going
+    int cached = lookahead > 2 ? lookahead : 2;
+    if (self->rowcacheLength < width*cached) {
+        uint16_t* rowcache = (uint16_t*)realloc(self->rowcache,(size_t)width*cached*sizeof(uint16_t));
+        if (rowcache==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->rowcache = rowcache;
+        self->rowcacheLength = width*cached;
+    }
+    int predicted = lookahead > 1 ? lookahead : 1;
+    if (self->residualLength < width*predicted) {
+        uint16_t* residual = (uint16_t*)realloc(self->residual,(size_t)width*predicted*sizeof(uint16_t));
+        if (residual==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->residual = residual;
+        uint8_t* ssss = (uint8_t*)realloc(self->ssss,(size_t)width*predicted);
+        if (ssss==NULL) return LJ92_ERROR_NO_MEMORY;
+        self->ssss = ssss;
+        self->residualLength = width*predicted;
+    }
+    if (self->streamReused) {
+        int ret = openStream(self);
+        if (ret != LJ92_ERROR_NONE) return ret;
+    }
+    self->streaming = 1;
+    return LJ92_ERROR_NONE;
+}
 
+int lj92_encoder_push(lj92_encoder encoder,
+                      uint16_t* rows, int count,
+                      int readLength, int skipLength) {
+    lje* self = encoder;
+    if (self==NULL || !self->streaming) return LJ92_ERROR_BAD_HANDLE;
+    if (count<0 || count > self->height - self->pushed || readLength<1) return LJ92_ERROR_BAD_HANDLE;
+    int width = self->samples;
+    self->readLength = readLength;
+    self->skipLength = skipLength;
+    uint16_t* pixel = rows;
+    int scan = readLength;
+    for (int i=0;i<count;i++) {
+        int row = self->pushed;
+        int ret;
+        if (self->lookahead) {
+            // Held back until there are enough to build the table from
+            ret = gatherRowSamples(self,&pixel,&scan,&self->rowcache[(size_t)row*width]);
+            if (ret == LJ92_ERROR_NONE) {
+                self->pushed++;
+                if (self->pushed == self->lookahead) ret = startStream(self);
+            }
+        } else {
+            // The row it's predicted from is never in the slot this one goes in
+            uint16_t* cur = &self->rowcache[(row&1)*width];
+            ret = gatherRowSamples(self,&pixel,&scan,cur);
+            if (ret == LJ92_ERROR_NONE) {
+                predictOneRow(self,self->predictRow[self->predictor],cur,self->prevRow,self->residual,self->ssss);
+                self->histogram(self->ssss,width,self->hist);
+                ret = writeStreamRow(self,self->residual,self->ssss);
+                self->prevRow = cur;
+                self->pushed++;
+            }
+        }
+        if (ret != LJ92_ERROR_NONE) {
+            self->streaming = 0;
+            return ret;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+int lj92_encoder_finish(lj92_encoder encoder,int* encodedLength) {
+    lje* self = encoder;
+    if (self==NULL || !self->streaming) return LJ92_ERROR_BAD_HANDLE;
+    self->streaming = 0;
+    if (self->pushed != self->height) return LJ92_ERROR_BAD_HANDLE;
+    // Pad the last byte, then EOI
+    if (self->bufferLength - self->stream.w < 16) {
+        int ret = sinkStream(self);
+        if (ret != LJ92_ERROR_NONE) return ret;
+    }
+    flushBits(&self->stream);
+    self->stream.out[self->stream.w++] = 0xff;
+    self->stream.out[self->stream.w++] = 0xd9; //EOI
+    int ret = sinkStream(self);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    if (self->trainImages) {
+        if (self->streamReused) {
+            // Train a new table from the next image if this one didn't suit it
+            if (histDrifted(self,self->hist,(int64_t)self->samples*self->height)) {
+                self->trained = 0;
+                memset(self->trainHist,0,sizeof(self->trainHist));
+            }
+        } else {
+            if (self->trained >= self->trainImages || self->predictor != self->trainedPredictor) {
+                self->trained = 0;
+                memset(self->trainHist,0,sizeof(self->trainHist));
+            }
+            trainTable(self);
+        }
+    }
+    if (self->sunk > INT32_MAX) return LJ92_ERROR_NO_MEMORY;
+    *encodedLength = (int)self->sunk;
+    return LJ92_ERROR_NONE;
+}
+
+/* Encoder
+ * Read tile from an image and encode in one shot
+ * Return the encoded data
+ */
+int lj92_encode(uint16_t* image, int width, int height, int bitdepth,
+                int readLength, int skipLength,
+                uint16_t* delinearize,int delinearizeLength,
+                uint8_t** encoded, int* encodedLength) {
+    lj92_encoder encoder;
+    uint8_t* target = NULL;
+    int targetLength = 0;
+    int ret = lj92_encoder_create(&encoder);
+    if (ret != LJ92_ERROR_NONE) return ret;
+    ret = lj92_encoder_encode_to(encoder,image,width,height,bitdepth,1,
+                                 readLength,skipLength,delinearize,delinearizeLength,
+                                 &target,&targetLength,encodedLength);
+    lj92_encoder_destroy(encoder);
+    if (ret != LJ92_ERROR_NONE) {
+        free(target);
+        return ret;
+    }
+    // Hand back only what was used
+    uint8_t* shrunk = (uint8_t*)realloc(target,*encodedLength);
+    *encoded = shrunk ? shrunk : target;
+    return ret;
+}
@@ -30,13 +30,23 @@ enum LJ92_ERRORS {
     LJ92_ERROR_NO_MEMORY = -2,
     LJ92_ERROR_BAD_HANDLE = -3,
     LJ92_ERROR_TOO_WIDE = -4,
+    LJ92_ERROR_SINK = -5,
+    LJ92_ERROR_NO_GAIN = -6,
 };
 
 typedef struct _ljp* lj92;
 
+/* Runs task(arg,i) for every i in [0,count) and returns once all are done,
+ * in any order and on any threads. The encoder and decoder use one, if given,
+ * for the restart intervals of an image, which are independent of each other.
+ */
+typedef void (*lj92_parallel)(void* context,int count,void (*task)(void* arg,int index),void* arg);
+
 /* Parse a lossless JPEG (1992) structure returning
  * - a handle that can be used to decode the data
  * - width/height/bitdepth of the data
+ * The width is in samples: a stream with several components has them
+ * interleaved, so each row holds width/components pixels.
  * Returns status code.
  * If status == LJ92_ERROR_NONE, handle must be closed with lj92_close
  */
@@ -44,6 +54,11 @@ int lj92_open(lj92* lj, // Return handle here
               uint8_t* data,int datalen, // The encoded data
               int* width,int* height,int* bitdepth); // Width, height and bitdepth
 
+/* Decode the restart intervals of the image, if it has them, with run
+ * instead of one after the other. The intervals have to be whole rows.
+ */
+void lj92_set_parallel(lj92 lj,lj92_parallel run,void* context);
+
 /* Release a decoder object */
 void lj92_close(lj92 lj);
 
@@ -51,6 +66,7 @@ void lj92_close(lj92 lj);
  * Decode previously opened lossless JPEG (1992) into a 2D tile of memory
  * Starting at target, write writeLength 16bit values, then skip 16bit skipLength value before writing again
  * If linearize is not NULL, use table at linearize to convert data values from output value to target value
+ * A point transform in the scan header is undone by shifting each sample back up before linearizing
  * Data is only correct if LJ92_ERROR_NONE is returned
  */
 int lj92_decode(lj92 lj,
@@ -67,4 +83,150 @@ int lj92_encode(uint16_t* image, int width, int height, int bitdepth,
                 int readLength, int skipLength,
                 uint16_t* delinearize,int delinearizeLength,
                 uint8_t** encoded, int* encodedLength);
+
+typedef struct _lje* lj92_encoder;
+
+/* Create an encoder that can be used for any number of images.
+ * Its scratch space and output buffer are kept between calls and only grow,
+ * so encoding tiles of the same size over and over allocates nothing.
+ * Release with lj92_encoder_destroy
+ */
+int lj92_encoder_create(lj92_encoder* encoder);
+
+/* Predictor for the following images, 1 to 7 as numbered in the standard,
+ * or 0 to choose one for each image: every 8th row is tried with all seven,
+ * and the one that would take the fewest bits is used. 6 is the default and
+ * the fastest.
+ */
+void lj92_encoder_set_predictor(lj92_encoder encoder,int predictor);
+
+/* Predictor the last image was encoded with */
+int lj92_encoder_predictor(lj92_encoder encoder);
+
+/* Near-lossless: drop the pt lowest bits of every sample of the following
+ * images (the point transform of the standard, 0 to 15 and less than the
+ * bitdepth), rounding to nearest. The scan header says so, and decoders that
+ * follow the standard shift the samples back up, so each is within 2^(pt-1)
+ * of the original (short of the top 2^pt-1 values, which come back as the
+ * largest that fits). Some, such as dcraw's, leave them shifted down instead.
+ * 0, lossless, is the default.
+ */
+void lj92_encoder_set_point_transform(lj92_encoder encoder,int pt);
+
+/* Give up on any following image whose stream would be longer than maxLength
+ * bytes, or 0 for no limit (the default). The length is known from the
+ * histogram once the image has been predicted, short of the 0x00 stuffed after
+ * each 0xFF byte, so nothing is written and the output isn't grown for it:
+ * encoding returns LJ92_ERROR_NO_GAIN with *encodedLength set to that length.
+ * For callers that would rather store such images some other way.
+ */
+void lj92_encoder_set_limit(lj92_encoder encoder,int maxLength);
+
+/* Restart the prediction every rows rows of the following images, with an
+ * RSTn marker between intervals and their length in a DRI segment, or 0 for
+ * no restarts (the default). An interval is at most 65535 pixels, so rows
+ * is cut down to fit for wide images. Each interval is predicted and written
+ * separately, with the runner from lj92_encoder_set_parallel, at the cost of
+ * two bytes a marker and the padding before it.
+ */
+void lj92_encoder_set_restart(lj92_encoder encoder,int rows);
+
+/* Encode the restart intervals of an image with run instead of one after the other */
+void lj92_encoder_set_parallel(lj92_encoder encoder,lj92_parallel run,void* context);
+
+/* Keep one huffman table for a sequence of similar images, such as the
+ * tiles of a reel, instead of building one per image.
+ * The table is built from the next trainImages images combined, then reused
+ * without gathering frequencies. Every 16th row of each image is checked
+ * against it, and once the table costs noticeably more than it did on the
+ * images it came from, it is rebuilt starting from that image.
+ * trainImages of 0 goes back to a table per image (the default).
+ */
+void lj92_encoder_reuse_table(lj92_encoder encoder,int trainImages);
+
+/* Release an encoder and its buffers */
+void lj92_encoder_destroy(lj92_encoder encoder);
+
+/*
+ * As lj92_encode, but the stream is written to the encoder's own buffer.
+ * The returned pointer belongs to the encoder and stays valid until its next use.
+ * Each pixel has 1 to 4 components, interleaved in the image, so rows are
+ * width*components samples long (readLength still counts samples). Every
+ * component is predicted from the same component of its neighbours, which
+ * suits a CFA read as two sensor rows per JPEG row and two components: the
+ * neighbours are then the same colour, except on the left (and upper left)
+ * of the pixel where each JPEG row moves on to the second sensor row.
+ */
+int lj92_encoder_encode(lj92_encoder encoder,
+                        uint16_t* image, int width, int height, int bitdepth, int components,
+                        int readLength, int skipLength,
+                        uint16_t* delinearize,int delinearizeLength,
+                        uint8_t** encoded, int* encodedLength);
+
+/*
+ * As lj92_encode, but the stream is written to the caller's buffer at *target,
+ * which holds *targetLength bytes. It is only realloc'd (updating both) if the
+ * worst case for this image might not fit, so *target may start out NULL.
+ */
+int lj92_encoder_encode_to(lj92_encoder encoder,
+                           uint16_t* image, int width, int height, int bitdepth, int components,
+                           int readLength, int skipLength,
+                           uint16_t* delinearize,int delinearizeLength,
+                           uint8_t** target, int* targetLength, int* encodedLength);
+
+/*
+ * Work out how long lj92_encoder_encode would make the stream for an image,
+ * without writing it: the image is predicted as it would be, and the length
+ * comes from its histogram and the code lengths of a table made for it. Only
+ * the 0x00 stuffed after each 0xFF byte of codes isn't counted, which is about
+ * one byte in 256 for noisy images. A table kept by lj92_encoder_reuse_table
+ * is neither used nor trained.
+ * With rowStep over 1 only every rowStep-th row is predicted, from the row
+ * above it, and the histogram scaled up to the whole image, which is that
+ * much quicker and usually lands within a fraction of a percent.
+ */
+int lj92_encoder_estimate(lj92_encoder encoder,
+                          uint16_t* image, int width, int height, int bitdepth, int components,
+                          int readLength, int skipLength,
+                          uint16_t* delinearize,int delinearizeLength,
+                          int rowStep, int* encodedLength);
+
+/* Takes the encoded stream a piece at a time, as it is written.
+ * Returns 0 if it took it, anything else stops the encoder with LJ92_ERROR_SINK.
+ */
+typedef int (*lj92_sink)(void* context,const uint8_t* data,int length);
+
+/*
+ * Start encoding an image that is pushed a few rows at a time, for when it
+ * arrives from a scanner or a capture source and shouldn't be held in memory
+ * whole. The stream goes to sink in pieces of a few rows as it is written.
+ * Only the height has to be known up front.
+ * A huffman table that lj92_encoder_reuse_table has finished training is used
+ * straight away. Otherwise the first lookahead rows (at least 1) are held back
+ * and the table, and the predictor if it's chosen per image, are made from
+ * them, with a code for every category in case later rows need it. Either way
+ * the whole image's frequencies go towards the next table when training.
+ * There are no restart intervals in a pushed image. The encoder can't be used
+ * for anything else until lj92_encoder_finish.
+ */
+int lj92_encoder_begin(lj92_encoder encoder,
+                       int width, int height, int bitdepth, int components,
+                       uint16_t* delinearize,int delinearizeLength,
+                       int lookahead, lj92_sink sink, void* context);
+
+/*
+ * Push the next count rows, read as a tile from rows as lj92_encoder_encode
+ * does. They are copied, so the caller can reuse the memory straight away.
+ */
+int lj92_encoder_push(lj92_encoder encoder,
+                      uint16_t* rows, int count,
+                      int readLength, int skipLength);
+
+/*
+ * End the image once all its rows have been pushed, handing the rest of the
+ * stream to the sink. encodedLength is what the sink has had in total.
+ * Returns LJ92_ERROR_BAD_HANDLE, as push does for rows past the end, if the
+ * row count doesn't match the height.
+ */
+int lj92_encoder_finish(lj92_encoder encoder,int* encodedLength);
 #endif
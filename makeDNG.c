@@ -33,17 +33,33 @@
  *
  *****************************************************************************/
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // gmtime_r
+#endif
+
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <math.h>
+#ifndef _WIN32
+#include <glob.h>
+#include <sys/mman.h>
+#endif
 #include <tiffio.h>
+#include <zlib.h>
 
 #include "prng.h"
 #include "lj92.h"
 #include "dng_utils.h"
+#include "threads.h"
+#include "tpool.h"
+#include "fifo.h"
+#include "dng_writer.h"
+#include "raw_stream.h"
 
 #define TIFFTAG_FORWARDMATRIX1 50964
 #define TIFFTAG_FORWARDMATRIX2 50965
@@ -51,6 +67,38 @@
 #define TIFFTAG_FRAMERATE 51044
 #define TIFFTAG_REELNAME 51081
 
+// Not every libtiff knows these EXIF 2.3 tags
+#ifndef EXIFTAG_TIFFEPSTANDARDID
+#define EXIFTAG_TIFFEPSTANDARDID 37398
+#endif
+#ifndef EXIFTAG_LENSMAKE
+#define EXIFTAG_LENSMAKE 42035
+#endif
+#ifndef EXIFTAG_LENSMODEL
+#define EXIFTAG_LENSMODEL 42036
+#endif
+#ifndef EXIFTAG_LENSSERIALNUMBER
+#define EXIFTAG_LENSSERIALNUMBER 42037
+#endif
+
+// JPEG rows each --low-memory encoder holds back to build a huffman table from, see stream_scanlines
+#define STREAM_LOOKAHEAD 16
+
+// --estimate predicts every Nth JPEG row of a tile for its LJ92 length, and compresses every Nth band
+// of 16 rows for real to time both compressions and for the Deflate length, though at least so many
+// samples over the whole run, see estimate_frame
+#define ESTIMATE_ROW_STEP 4
+#define ESTIMATE_BAND_STEP 64
+#define ESTIMATE_MIN_SAMPLES (1 << 18)
+
+// What encode_tile does with a tile for --estimate
+enum tile_estimate
+{
+    ESTIMATE_NONE = 0,      // Encode the whole tile
+    ESTIMATE_LENGTH,        // Only work out the LJ92 length
+    ESTIMATE_BANDS,         // Compress just the sampled bands, see sample_bands
+};
+
 enum tiff_cfa_color
 {
     CFA_RED = 0,
@@ -74,112 +122,962 @@ static const char cfa_patterns[4][CFA_NUM_PATTERNS] = {
     [CFA_RGGB] = { CFA_RED, CFA_GREEN, CFA_GREEN, CFA_BLUE },
 };
 
-static const TIFFFieldInfo xtiffFieldInfo[] = {
-    { TIFFTAG_FORWARDMATRIX1, -1, -1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 1, "ForwardMatrix1" },
-    { TIFFTAG_FORWARDMATRIX2, -1, -1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 1, "ForwardMatrix2" },
-    { TIFFTAG_TIMECODES, -1, -1, TIFF_BYTE, FIELD_CUSTOM, 1, 1, "TimeCodes" },
-    { TIFFTAG_FRAMERATE, -1, -1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 1, "FrameRate" },
-    { TIFFTAG_REELNAME, -1, -1, TIFF_ASCII, FIELD_CUSTOM, 1, 0, "ReelName" }
-};
+// A tile's buffer is kept from one frame to the next and only grows
+typedef struct
+{
+    uint8_t *data;
+    int capacity;
+    int length;
+    int status;
+    int predictor;          // LJ92 predictor the tile was encoded with
+    int rows;               // Rows of it an --estimate compressed, see sample_bands
+} encoded_tile;
+
+// Working buffers for whichever tile a pool thread is compressing, indexed by tpool_thread
+typedef struct tile_scratch
+{
+    lj92_encoder lj92;
+    uint16_t *padded;       // Edge tiles padded out to full size
+    size_t padded_size;
+    uint8_t *planes;        // Byte planes for Deflate
+    size_t planes_size;
+    uint16_t *sample;       // Bands --estimate compresses
+    size_t sample_size;
+    int busy;               // A tile on this thread is using it
+    struct tile_scratch *nested;  // For tiles the thread runs while that one waits on the pool
+} tile_scratch;
+
+typedef struct
+{
+    tpool *pool;
+    const uint16_t *image;  // Top left of the frame
+    uint32_t width;         // Frame width, also the row stride
+    uint32_t height;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tiles_across;
+    int compression;
+    int bits;               // Significant bits of the samples, which LJ92 is encoded at
+    int reuse_tables;
+    int predictor;
+    int restart;            // LJ92 rows per restart interval, 0 for none
+    int point_transform;    // Low bits LJ92 drops, 0 for lossless
+    encoded_tile *tiles;
+    tile_scratch *scratch;
+    float_t scale;          // Maps samples to [0, 1] for Deflate
+    int estimate;           // enum tile_estimate
+    int limit;              // LJ92 tiles longer than this give up, 0 for no limit
+    int redo;               // Only encode the tiles that gave up, see choose_compression
+    int band_step;          // ESTIMATE_BANDS takes one in this many bands of 16 rows,
+    double band_offset;     // which one given as a fraction of the step, see encode_tile
+} tile_batch;
+
+static tile_scratch *create_scratch( const tpool *pool )
+{
+    return calloc( tpool_size( pool ), sizeof( tile_scratch ) );
+}
+
+static void free_scratch( tile_scratch *scratch, const tpool *pool )
+{
+    for( int i = 0; scratch && i < tpool_size( pool ); i++ )
+    {
+        tile_scratch *s = &scratch[i];
+        while( s )
+        {
+            tile_scratch *nested = s->nested;
+            lj92_encoder_destroy( s->lj92 );
+            free( s->padded );
+            free( s->planes );
+            free( s->sample );
+            if( s != &scratch[i] )
+                free( s );
+            s = nested;
+        }
+    }
+    free( scratch );
+}
+
+// A tile waiting on its restart intervals lets its thread run other tiles meanwhile, which take the next free scratch along
+static tile_scratch *enter_scratch( tile_scratch *scratch )
+{
+    while( scratch->busy )
+    {
+        if( !scratch->nested && (scratch->nested = calloc( 1, sizeof( tile_scratch ) )) == NULL )
+            return NULL;
+        scratch = scratch->nested;
+    }
+    scratch->busy = 1;
+    return scratch;
+}
+
+// Lets LJ92 spread the restart intervals of a tile over the pool
+static void run_on_pool( void *pool, int count, void (*task)( void *arg, int index ), void *arg )
+{
+    tpool_run( pool, count, task, arg );
+}
+
+// Make sure *buf holds at least size bytes, keeping what's there
+static int reserve( void *buf, size_t *capacity, size_t size )
+{
+    if( size <= *capacity )
+        return 0;
+    void *grown = realloc( *(void**)buf, size );
+    if( !grown )
+        return -1;
+    *(void**)buf = grown;
+    *capacity = size;
+    return 0;
+}
+
+// Adobe Deflate tiles hold 16-bit floats run through the TIFF floating point predictor,
+// which is what libtiff would do for us in TIFFWriteTile if we weren't compressing tiles ourselves.
+static int deflate_float_tile( const uint16_t *image, uint32_t stride, uint32_t width, uint32_t height,
+                               float_t scale, tile_scratch *scratch, encoded_tile *tile )
+{
+    const uLong size = (uLong)width * height * 2;
+    size_t capacity = tile->capacity;
+    uLongf length = compressBound( size );
+    if( length > INT_MAX || reserve( &scratch->planes, &scratch->planes_size, size ) ||
+        reserve( &tile->data, &capacity, length ) )
+        return -1;
+    tile->capacity = (int)capacity;
+    uint8_t *planes = scratch->planes;
+    for( uint32_t row = 0; row < height; row++ )
+    {
+        // Split each row into byte planes, most significant first, then difference the bytes
+        uint8_t *p = &planes[row * width * 2];
+        for( uint32_t i = 0; i < width; i++ )
+        {
+            uint16_t half = DNG_FloatToHalf( float_bits( image[row * stride + i] * scale ) );
+            p[i] = half >> 8;
+            p[width + i] = half & 0xff;
+        }
+        for( uint32_t i = width * 2 - 1; i > 0; i-- )
+            p[i] -= p[i - 1];
+    }
+    if( compress2( tile->data, &length, planes, size, 9 ) != Z_OK )
+        return -1;
+    tile->length = (int)length;
+    return 0;
+}
 
-static TIFFExtendProc parent_extender = NULL;  // In case we want a chain of extensions
+// Tiles hanging off the right or bottom edge are padded by repeating the last two columns or rows,
+// which keeps the CFA phase intact so the padding costs next to nothing to compress.
+static void pad_row( const uint16_t *image, uint32_t stride, uint32_t width, uint32_t height,
+                     uint32_t tile_width, uint32_t row, uint16_t *dst )
+{
+    uint32_t y = row;
+    if( y >= height )
+        y = height < 2 ? 0 : height - 2 + ((y - height) & 1);
+    const uint16_t *src = &image[y * stride];
+    memcpy( dst, src, width * sizeof( uint16_t ) );
+    for( uint32_t x = width; x < tile_width; x++ )
+        dst[x] = src[width < 2 ? 0 : width - 2 + ((x - width) & 1)];
+}
 
-static void registerCustomTIFFTags( TIFF *tif )
+static uint16_t *pad_tile( const uint16_t *image, uint32_t stride, uint32_t width, uint32_t height,
+                           uint32_t tile_width, uint32_t tile_height, tile_scratch *scratch )
 {
-    // Install the extended Tag field info
-    TIFFMergeFieldInfo( tif, xtiffFieldInfo, sizeof( xtiffFieldInfo ) / sizeof( xtiffFieldInfo[0] ) );
+    if( reserve( &scratch->padded, &scratch->padded_size, (size_t)tile_width * tile_height * sizeof( uint16_t ) ) )
+        return NULL;
+    for( uint32_t row = 0; row < tile_height; row++ )
+        pad_row( image, stride, width, height, tile_width, row, &scratch->padded[row * tile_width] );
+    return scratch->padded;
+}
 
-    if( parent_extender )
-        (*parent_extender)(tif);
+// --estimate: gather the bands of 16 rows of a tile at top that are numbered phase modulo step, counting
+// down the frame, padded as pad_tile would. Returns how many rows that is, which may be none, or -1.
+static int sample_bands( const uint16_t *image, uint32_t stride, uint32_t width, uint32_t height,
+                         uint32_t tile_width, uint32_t tile_height, uint32_t top, int step, int phase,
+                         tile_scratch *scratch )
+{
+    int rows = 0;
+    if( reserve( &scratch->sample, &scratch->sample_size, ((size_t)tile_height / step + 32) * tile_width * sizeof( uint16_t ) ) )
+        return -1;
+    for( uint32_t row = 0; row < tile_height; row++ )
+        if( (top + row) / 16 % step == (uint32_t)phase )
+            pad_row( image, stride, width, height, tile_width, row, &scratch->sample[rows++ * tile_width] );
+    return rows;
 }
 
-static void augment_libtiff_with_custom_tags( void )
+static void encode_tile( void *arg, int index )
 {
-    static int first_time = 1;
-    if( !first_time )
+    tile_batch *batch = arg;
+    encoded_tile *tile = &batch->tiles[index];
+    const uint32_t x = (index % batch->tiles_across) * batch->tile_width;
+    const uint32_t y = (index / batch->tiles_across) * batch->tile_height;
+    const uint32_t tw = batch->tile_width;
+    uint32_t th = batch->tile_height;
+    const uint16_t *image = &batch->image[y * batch->width + x];
+    uint32_t stride = batch->width;
+    if( batch->redo && tile->status != LJ92_ERROR_NO_GAIN )
         return;
-    first_time = 0;
-    parent_extender = TIFFSetTagExtender( registerCustomTIFFTags );
+    tile_scratch *scratch = enter_scratch( &batch->scratch[tpool_thread( batch->pool )] );
+
+    tile->status = -1;
+    if( !scratch )
+        return;
+    const uint32_t w = x + tw > batch->width ? batch->width - x : tw;
+    const uint32_t h = y + th > batch->height ? batch->height - y : th;
+    if( batch->estimate == ESTIMATE_BANDS )
+    {
+        // Tiles side by side take different bands, spread by steps of sqrt(2) - 1. The bands are compressed
+        // as if they were the whole tile; their edges are even, so the rows pair up for LJ92.
+        const int column = index % batch->tiles_across;
+        const int phase = (int)(batch->band_step * fmod( batch->band_offset + column * 0.414214, 1.0 ));
+        const int rows = sample_bands( image, stride, w, h, tw, th, y, batch->band_step, phase, scratch );
+        if( rows < 0 )
+            goto done;
+        tile->rows = rows;
+        if( rows == 0 )
+        {
+            tile->length = 0;
+            tile->status = 0;
+            goto done;
+        }
+        image = scratch->sample;
+        th = rows;
+        stride = tw;
+    }
+    else if( w < tw || h < th )
+    {
+        if( (image = pad_tile( image, stride, w, h, tw, th, scratch )) == NULL )
+            goto done;
+        stride = tw;
+    }
+
+    if( batch->compression == COMPRESSION_JPEG )
+    {
+        if( !scratch->lj92 )
+        {
+            if( lj92_encoder_create( &scratch->lj92 ) )
+                goto done;
+            lj92_encoder_reuse_table( scratch->lj92, batch->reuse_tables );
+            lj92_encoder_set_predictor( scratch->lj92, batch->predictor );
+            lj92_encoder_set_restart( scratch->lj92, batch->restart );
+            lj92_encoder_set_point_transform( scratch->lj92, batch->point_transform );
+            lj92_encoder_set_parallel( scratch->lj92, run_on_pool, batch->pool );
+        }
+        lj92_encoder_set_limit( scratch->lj92, batch->limit );
+        // Two CFA rows make one JPEG row of two-component pixels, so the neighbours that predict
+        // a sample are the same colour, except to the left of the middle pixel, where the JPEG row
+        // moves on to the second CFA row. Tiles are always an even height.
+        if( batch->estimate == ESTIMATE_LENGTH )
+            tile->status = lj92_encoder_estimate( scratch->lj92, (uint16_t*)image, tw, th / 2, batch->bits, 2, tw, stride - tw,
+                                                  NULL, 0, ESTIMATE_ROW_STEP, &tile->length );
+        else
+            tile->status = lj92_encoder_encode_to( scratch->lj92, (uint16_t*)image, tw, th / 2, batch->bits, 2, tw, stride - tw,
+                                                   NULL, 0, &tile->data, &tile->capacity, &tile->length );
+        tile->predictor = lj92_encoder_predictor( scratch->lj92 );
+    }
+    else
+        tile->status = deflate_float_tile( image, stride, tw, th, batch->scale, scratch, tile );
+done:
+    scratch->busy = 0;
 }
 
-int main( int argc, char **argv )
+// White balance gains calculated with dcamprof
+static const float_t balance_unity[] = { 1.00f, 1.00f, 1.00f };
+static const float_t balance_D50[] = { 1.57f, 1.00f, 1.51f };
+static const float_t balance_D55[] = { 1.67f, 1.00f, 1.40f };
+static const float_t balance_D65[] = { 1.82f, 1.00f, 1.25f };
+static const float_t balance_D75[] = { 1.93f, 1.00f, 1.15f };
+static const float_t balance_StdA[] = { 1.00f, 1.00f, 2.53f };
+
+static const float_t as_shot_D50[] = { 0.636099f, 1.0f, 0.661984f };
+static const float_t as_shot_D55[] = { 0.599260f, 1.0f, 0.713991f };
+static const float_t as_shot_D65[] = { 0.549323f, 1.0f, 0.802144f };
+static const float_t as_shot_D75[] = { 0.518043f, 1.0f, 0.872091f };
+static const float_t as_shot_StdA[] = { 0.998233f, 1.0f, 0.394600f };
+
+static const uint16_t cfa_dimensions[] = { 2, 2 };
+static const double_t exposure_time[] = { 1.0f, 5.0f };
+static const double_t f_number = 2.5f;
+static const uint16_t isospeed[] = { 90 };
+static const float_t *balance = balance_unity;
+static const float_t *as_shot = as_shot_D55;
+static const float_t resolution = 7300.0f;
+static const float_t framerate[] = { 18, 1 };
+
+// I'm working with Ektachrome film, so dcamprof was patched to add Ektaspace primaries and then used to derive the matrices below.
+// The spectral sensitivity chart in the Point Grey data sheet was used instead of actual ColorChecker test shots since that
+// seemed to produce better results. YMMV. You can always assign a .dcp file with RawTherapee later if you want to override this.
+
+static const float_t cm1[] = { 1.299046f, -0.514857f, -0.123131f, -0.130278f, 1.028754f,  0.117381f, -0.053247f,  0.190644f, 0.633399f };
+static const float_t fm1[] = { 0.516209f,  0.387509f,  0.060500f,  0.059270f, 1.054966f, -0.114236f,  0.028743f, -0.288736f, 1.085194f };
+static const int illuminant1 = 23; // StdA=17, D50=23, D55=20, D65=21
+
+// Settings shared by every frame of a run
+typedef struct
+{
+    int cfa;
+    int compression;
+    const char *reelname;
+    uint32_t tile_width;    // 0 picks two tiles side by side
+    uint32_t tile_height;
+    int bits;               // Significant bits in each 16-bit sample, 0 for all of them
+    int msb;                // Those bits are the top of the sample rather than the bottom
+    int reuse_tables;       // Keep LJ92 huffman tables from one tile to the next while they fit
+    int predictor;          // LJ92 predictor 1-7, or 0 to pick one per tile
+    int restart;            // Rows of a tile per LJ92 restart interval, 0 for none
+    int near_lossless;      // Low bits of each sample LJ92 drops (the point transform), 0 for lossless
+    int low_memory;         // Encode LJ92 tiles from TIFF scanlines as they're read, see stream_scanlines
+    int estimate;           // Only work out what every Nth frame would take, see run_estimate. 0 converts.
+    int min_gain;           // Percentage LJ92 has to save on a frame, or it's written uncompressed
+    int report;             // Print the size of each tile
+} dng_options;
+
+// Per-run state that is worth keeping between frames
+typedef struct
+{
+    const dng_options *opt;
+    tpool *pool;
+    tile_scratch *scratch;  // Shared by every converter on the pool
+    uint8_t *buf;           // Frame buffer
+    size_t buf_size;
+    const uint8_t *image;   // The frame's pixels, either buf or straight from the mapped input
+    void *map;
+    size_t map_size;
+    encoded_tile *tiles;
+    int tiles_size;
+    lj92_encoder *streams;  // One per tile across for --low-memory, kept from frame to frame like the tiles
+    int streams_size;
+    struct prng rng;        // prng.c's global state isn't thread-safe, so every converter has its own
+
+    // The frame being converted, filled in by read_frame and encode_frame
+    int frame;
+    uint32_t width, height, bpp, spp, rps;
+    uint32_t tile_width, tile_height;
+    int tile_count;
+    int compression;        // What the frame is written with, see choose_compression
+    int streamed;           // The tiles were encoded while the frame was read
+    char datetime[20];
+} converter;
+
+// A batch shared by the frame tasks. Frames and their tiles run on the same pool, and
+// a frame only holds a converter while it's in flight.
+typedef struct
+{
+    tpool *pool;
+    converter *convs;       // One per frame in flight
+    converter **idle;       // Converters free for the next frame
+    int idle_count;
+    char **inputs;
+    int count;              // INT_MAX for a stream until it ends
+    raw_stream *stream;     // Frames come from here instead of inputs when set
+    const char *stream_path;
+    uint32_t stream_size[2];
+    const char *output_pattern;
+    int start_frame;
+    int ordered;            // Give outputs their final names strictly in sequence
+    mutex_t lock;
+    tpool_group frames;
+    int next;               // Next input to start
+    char *written;          // Inputs finished under their temporary name when ordered
+    int finalize;           // Next input to take its final name when ordered
+    int first_failure;      // Inputs from here on are abandoned
+} frame_batch;
+
+static void frame_timecode( int frame, uint8_t timecode[8] )
+{
+    // Time code is an integer cast to a hex string for our purposes
+    // There's more to it in SMPTE 12M/309/331 if you want to get into drop-frame or date/time
+    // For example, to indicate 17 frames you write 0x17 (not 0x11)
+    char buf[5];
+    memset( timecode, 0, 8 );
+    timecode[3] = (int)( frame / ( 3600 * framerate[0]/framerate[1] ) );
+    sprintf( buf, "0x%d", timecode[3] );
+    timecode[3] = (int)strtol( buf, NULL, 16 );
+    timecode[2] = (int)( frame / (   60 * framerate[0]/framerate[1] ) ) % 60;
+    sprintf( buf, "0x%d", timecode[2] );
+    timecode[2] = (int)strtol( buf, NULL, 16 );
+    timecode[1] = (int)( frame / (        framerate[0]/framerate[1] ) ) % 60;
+    sprintf( buf, "0x%d", timecode[1] );
+    timecode[1] = (int)strtol( buf, NULL, 16 );
+    timecode[0] = (int)fmod( frame, framerate[0]/framerate[1] );
+    sprintf( buf, "0x%d", timecode[0] );
+    timecode[0] = (int)strtol( buf, NULL, 16 );
+}
+
+static void make_uuid( struct prng *rng, uint8_t uuid[16], char uuid_str[33] )
+{
+    prng_r_get_bytes( rng, uuid, 16 );
+    uuid[6] &= 0x0F;
+    uuid[6] |= ((4 << 4) & 0xF0); // version 4
+    uuid[8] &= 0x3F;
+    uuid[8] |= ((2 << 6) & 0xC0); // variant 2
+    sprintf( uuid_str, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+        uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+        uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15] );
+}
+
+static int sample_bits( const dng_options *opt )
+{
+    return opt->bits > 0 && opt->bits < 16 ? opt->bits : 16;
+}
+
+static uint32_t white_level( const dng_options *opt )
+{
+    return (1u << sample_bits( opt )) - 1;
+}
+
+static void set_datetime( converter *conv, time_t t )
+{
+    struct tm tm = { 0 };
+#ifdef _WIN32
+    gmtime_s( &tm, &t );
+#else
+    gmtime_r( &t, &tm );
+#endif
+    snprintf( conv->datetime, sizeof( conv->datetime ), "%04d:%02d:%02d %02d:%02d:%02d",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec );
+}
+
+// The tile buffers stay allocated for the next frame
+static void release_tiles( converter *conv )
+{
+    conv->tile_count = 0;
+}
+
+// Drop the previous frame's mapping, if it had one
+static void unmap_input( converter *conv )
+{
+#ifndef _WIN32
+    if( conv->map )
+        munmap( conv->map, conv->map_size );
+#endif
+    conv->map = NULL;
+    conv->map_size = 0;
+}
+
+/*
+ * Uncompressed 16-bit CFA data in our byte order, with strips following each other
+ * without gaps, is already laid out the way the encoders want it. Map the file and
+ * point the converter at the first strip instead of copying it row by row, and let
+ * the kernel read ahead as the encoders walk through it.
+ */
+static int map_strips( converter *conv, TIFF *tif_in )
+{
+#ifdef _WIN32
+    return 0;
+#else
+    uint16_t compression = COMPRESSION_NONE, planar = PLANARCONFIG_CONTIG;
+    uint64_t *offsets = NULL, *counts = NULL;
+    const uint64_t frame_size = (uint64_t)conv->width * 2 * conv->height;
+    struct stat st;
+
+    TIFFGetField( tif_in, TIFFTAG_COMPRESSION, &compression );
+    TIFFGetField( tif_in, TIFFTAG_PLANARCONFIG, &planar );
+    if( compression != COMPRESSION_NONE || planar != PLANARCONFIG_CONTIG || conv->bpp != 16 ||
+        conv->spp != 1 || TIFFIsTiled( tif_in ) || TIFFIsByteSwapped( tif_in ) ||
+        !TIFFGetField( tif_in, TIFFTAG_STRIPOFFSETS, &offsets ) ||
+        !TIFFGetField( tif_in, TIFFTAG_STRIPBYTECOUNTS, &counts ) )
+        return 0;
+
+    uint64_t size = 0;
+    const uint32_t strips = TIFFNumberOfStrips( tif_in );
+    for( uint32_t i = 0; i < strips; i++ )
+    {
+        if( offsets[i] != offsets[0] + size )
+            return 0;
+        size += counts[i];
+    }
+    // Samples have to be aligned to be read as uint16_t
+    if( size < frame_size || offsets[0] % 2 )
+        return 0;
+
+    int fd = TIFFFileno( tif_in );
+    if( fstat( fd, &st ) || offsets[0] + frame_size > (uint64_t)st.st_size )
+        return 0;
+    // Read-only is fine: the pixels are only ever read, by the encoders or by writev
+    void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if( map == MAP_FAILED )
+        return 0;
+    posix_madvise( map, st.st_size, POSIX_MADV_SEQUENTIAL );
+    conv->map = map;
+    conv->map_size = st.st_size;
+    conv->image = (const uint8_t*)map + offsets[0];
+    return 1;
+#endif
+}
+
+// Lay out the frame's tiles and make room for them
+static int plan_tiles( converter *conv, uint32_t *tiles_across )
+{
+    const dng_options *opt = conv->opt;
+
+    // Default to two tiles side by side, padded out to a multiple of 16
+    conv->tile_width = opt->tile_width;
+    conv->tile_height = opt->tile_height;
+    if( !conv->tile_width )
+    {
+        conv->tile_width = ((conv->width + 1) / 2 + 15) & ~15;
+        conv->tile_height = (conv->height + 15) & ~15;
+    }
+
+    *tiles_across = (conv->width + conv->tile_width - 1) / conv->tile_width;
+    const uint32_t tiles_down = (conv->height + conv->tile_height - 1) / conv->tile_height;
+    const int tile_count = *tiles_across * tiles_down;
+    if( tile_count > conv->tiles_size )
+    {
+        encoded_tile *tiles = realloc( conv->tiles, tile_count * sizeof( encoded_tile ) );
+        if( !tiles )
+            return 1;
+        memset( &tiles[conv->tiles_size], 0, (tile_count - conv->tiles_size) * sizeof( encoded_tile ) );
+        conv->tiles = tiles;
+        conv->tiles_size = tile_count;
+    }
+    conv->tile_count = tile_count;
+    return 0;
+}
+
+// Fail the frame if any of its tiles couldn't be compressed, otherwise report them if asked
+static int check_tiles( converter *conv, const char *input )
+{
+    const dng_options *opt = conv->opt;
+    for( int i = 0; i < conv->tile_count; i++ )
+    {
+        if( conv->tiles[i].status )
+        {
+            fprintf( stderr, "%s: unable to compress tile data.\n", input );
+            release_tiles( conv );
+            return 1;
+        }
+    }
+    for( int i = 0; opt->report && i < conv->tile_count; i++ )
+    {
+        if( opt->compression == COMPRESSION_JPEG )
+            printf( "%s: tile %d, %d bytes, predictor %d\n", input, i, conv->tiles[i].length, conv->tiles[i].predictor );
+        else
+            printf( "%s: tile %d, %d bytes\n", input, i, conv->tiles[i].length );
+    }
+    return 0;
+}
+
+// LJ92 sink for --low-memory: append to the tile's buffer, which only grows
+static int append_tile( void *context, const uint8_t *data, int length )
+{
+    encoded_tile *tile = context;
+    size_t needed = (size_t)tile->length + length, capacity = tile->capacity;
+    if( needed > INT_MAX )
+        return -1;
+    // Grow by half again, as the stream arrives a few rows at a time
+    if( needed > capacity && reserve( &tile->data, &capacity, needed + needed / 2 < INT_MAX ? needed + needed / 2 : INT_MAX ) )
+        return -1;
+    tile->capacity = (int)capacity;
+    memcpy( &tile->data[tile->length], data, length );
+    tile->length = (int)needed;
+    return 0;
+}
+
+// Stop the band's encoders mid-image, so they're free for the next frame. Those that weren't begun don't mind.
+static int abandon_band( converter *conv, uint32_t tiles_across )
+{
+    int length;
+    for( uint32_t i = 0; i < tiles_across; i++ )
+        lj92_encoder_finish( conv->streams[i], &length );
+    return 1;
+}
+
+/*
+ * --low-memory: rather than reading the whole frame and then compressing its tiles,
+ * hand every pair of scanlines to the LJ92 encoders of the tiles they cross as soon
+ * as they're read. Only those two rows and the compressed tiles are held, not the
+ * frame. Each encoder holds back its first STREAM_LOOKAHEAD rows to build a huffman
+ * table from until it has one trained on earlier tiles, and the tiles are encoded
+ * on the reading thread instead of the pool.
+ */
+static int stream_scanlines( converter *conv, TIFF *tif_in, const char *input )
+{
+    const dng_options *opt = conv->opt;
+    const int shift = opt->msb ? 16 - sample_bits( opt ) : 0;
+    uint32_t tiles_across;
+
+    conv->tile_count = 0;
+    if( plan_tiles( conv, &tiles_across ) )
+        return 1;
+    const uint32_t tw = conv->tile_width, th = conv->tile_height;
+    if( (int)tiles_across > conv->streams_size )
+    {
+        lj92_encoder *streams = realloc( conv->streams, tiles_across * sizeof( lj92_encoder ) );
+        if( !streams )
+            return 1;
+        memset( &streams[conv->streams_size], 0, (tiles_across - conv->streams_size) * sizeof( lj92_encoder ) );
+        conv->streams = streams;
+        conv->streams_size = tiles_across;
+    }
+    for( uint32_t i = 0; i < tiles_across; i++ )
+    {
+        if( conv->streams[i] )
+            continue;
+        if( lj92_encoder_create( &conv->streams[i] ) )
+            return 1;
+        lj92_encoder_reuse_table( conv->streams[i], opt->reuse_tables );
+        lj92_encoder_set_predictor( conv->streams[i], opt->predictor );
+        lj92_encoder_set_point_transform( conv->streams[i], opt->near_lossless );
+    }
+
+    // Two rows, each padded out to whole tiles and with room for whatever libtiff reads into it
+    const size_t row_size = (size_t)tiles_across * tw * 2;
+    const size_t slot = row_size > (size_t)TIFFScanlineSize( tif_in ) ? row_size : (size_t)TIFFScanlineSize( tif_in );
+    if( slot * 2 > conv->buf_size )
+    {
+        _TIFFfree( conv->buf );
+        conv->buf_size = 0;
+        if( (conv->buf = _TIFFmalloc( slot * 2 )) == NULL )
+            return 1;
+        conv->buf_size = slot * 2;
+    }
+    conv->image = NULL;
+
+    // From here on, a tile that can't be encoded fails the frame through check_tiles
+    conv->streamed = 1;
+    for( int i = 0; i < conv->tile_count; i++ )
+        conv->tiles[i].status = -1;
+    for( int t = 0; t < conv->tile_count; t += tiles_across )
+    {
+        const uint32_t y0 = t / tiles_across * th;
+        encoded_tile *band = &conv->tiles[t];
+        for( uint32_t i = 0; i < tiles_across; i++ )
+        {
+            band[i].length = 0;
+            if( lj92_encoder_begin( conv->streams[i], tw, th / 2, sample_bits( opt ), 2, NULL, 0,
+                                    STREAM_LOOKAHEAD, append_tile, &band[i] ) )
+            {
+                fprintf( stderr, "%s: unable to compress tile data.\n", input );
+                return abandon_band( conv, tiles_across );
+            }
+        }
+        for( uint32_t y = y0; y < y0 + th; y++ )
+        {
+            uint16_t *row = (uint16_t*)&conv->buf[(y & 1) * slot];
+            if( y < conv->height )
+            {
+                if( TIFFReadScanline( tif_in, row, y, 0 ) < 0 )
+                    return abandon_band( conv, tiles_across );
+                uint16_t any = 0;
+                for( uint32_t x = 0; shift && x < conv->width; x++ )
+                {
+                    any |= row[x];
+                    row[x] >>= shift;
+                }
+                if( any & ((1u << shift) - 1) )
+                {
+                    fprintf( stderr, "%s: samples have more than %d significant bits.\n", input, sample_bits( opt ) );
+                    return abandon_band( conv, tiles_across );
+                }
+                // Pad out to whole tiles the way pad_tile does
+                for( uint32_t x = conv->width; x < tiles_across * tw; x++ )
+                    row[x] = row[conv->width < 2 ? 0 : conv->width - 2 + ((x - conv->width) & 1)];
+            }
+            else if( conv->height < 2 )
+                memcpy( row, conv->buf, row_size );
+            // Rows past the bottom repeat the last two, which are already in place since each row's slot follows its parity
+
+            // Two CFA rows make one JPEG row, as in encode_tile
+            for( uint32_t i = 0; (y & 1) && i < tiles_across; i++ )
+            {
+                if( lj92_encoder_push( conv->streams[i], (uint16_t*)conv->buf + i * tw, 1, tw, slot / 2 - tw ) )
+                {
+                    fprintf( stderr, "%s: unable to compress tile data.\n", input );
+                    return abandon_band( conv, tiles_across );
+                }
+            }
+        }
+        for( uint32_t i = 0; i < tiles_across; i++ )
+        {
+            band[i].status = lj92_encoder_finish( conv->streams[i], &band[i].length );
+            band[i].predictor = lj92_encoder_predictor( conv->streams[i] );
+        }
+    }
+    return 0;
+}
+
+// Copy the pixels into the frame buffer, decoding as needed
+static int read_scanlines( converter *conv, TIFF *tif_in )
+{
+    // The frame buffer only grows, so a reel of same-sized frames allocates it once
+    size_t frame_size = (size_t)TIFFScanlineSize( tif_in ) * conv->height;
+    if( frame_size > conv->buf_size )
+    {
+        _TIFFfree( conv->buf );
+        conv->buf_size = 0;
+        if( (conv->buf = _TIFFmalloc( frame_size )) == NULL )
+            return 1;
+        conv->buf_size = frame_size;
+    }
+
+    for( uint32_t row = 0; row < conv->height; row++ )
+        TIFFReadScanline( tif_in, &conv->buf[row * conv->width * 2], row, 0 );
+    conv->image = conv->buf;
+    return 0;
+}
+
+// Read the input's properties and pixels into the converter
+static int read_frame( converter *conv, const char *input, int frame )
 {
     int status = 1;
-    if( argc < 3 ) goto usage;
-
-    // White balance gains calculated with dcamprof
-    static const float_t balance_unity[] = { 1.00f, 1.00f, 1.00f };
-    static const float_t balance_D50[] = { 1.57f, 1.00f, 1.51f };
-    static const float_t balance_D55[] = { 1.67f, 1.00f, 1.40f };
-    static const float_t balance_D65[] = { 1.82f, 1.00f, 1.25f };
-    static const float_t balance_D75[] = { 1.93f, 1.00f, 1.15f };
-    static const float_t balance_StdA[] = { 1.00f, 1.00f, 2.53f };
-
-    static const float_t as_shot_D50[] = { 0.636099f, 1.0f, 0.661984f };
-    static const float_t as_shot_D55[] = { 0.599260f, 1.0f, 0.713991f };
-    static const float_t as_shot_D65[] = { 0.549323f, 1.0f, 0.802144f };
-    static const float_t as_shot_D75[] = { 0.518043f, 1.0f, 0.872091f };
-    static const float_t as_shot_StdA[] = { 0.998233f, 1.0f, 0.394600f };
-
-    static const uint16_t cfa_dimensions[] = { 2, 2 };
-    static const double_t exposure_time[] = { 1.0f, 5.0f };
-    static const double_t f_number = 2.5f;
-    static const uint16_t isospeed[] = { 90 };
-    static const float_t *balance = balance_unity;
-    static const float_t *as_shot = as_shot_D55;
-    static const float_t resolution = 7300.0f;
-    static const float_t framerate[] = { 18, 1 };
-    uint8_t timecode[8] = { 0 };
+    TIFF *tif_in = 0;
 
-    // I'm working with Ektachrome film, so dcamprof was patched to add Ektaspace primaries and then used to derive the matrices below.
-    // The spectral sensitivity chart in the Point Grey data sheet was used instead of actual ColorChecker test shots since that
-    // seemed to produce better results. YMMV. You can always assign a .dcp file with RawTherapee later if you want to override this.
+    unmap_input( conv );
+    conv->frame = frame;
+    conv->streamed = 0;
+    conv->width = conv->height = conv->bpp = conv->spp = conv->rps = 0;
+    if( (tif_in = TIFFOpen( input, "r" )) == NULL )
+    {
+        perror( input );
+        goto fail;
+    }
 
-    static const float_t cm1[] = { 1.299046f, -0.514857f, -0.123131f, -0.130278f, 1.028754f,  0.117381f, -0.053247f,  0.190644f, 0.633399f };
-    static const float_t fm1[] = { 0.516209f,  0.387509f,  0.060500f,  0.059270f, 1.054966f, -0.114236f,  0.028743f, -0.288736f, 1.085194f };
-    static const int illuminant1 = 23; // StdA=17, D50=23, D55=20, D65=21
+    TIFFGetField( tif_in, TIFFTAG_IMAGEWIDTH, &conv->width );
+    TIFFGetField( tif_in, TIFFTAG_IMAGELENGTH, &conv->height );
+    TIFFGetField( tif_in, TIFFTAG_BITSPERSAMPLE, &conv->bpp );
+    TIFFGetField( tif_in, TIFFTAG_SAMPLESPERPIXEL, &conv->spp );
+    TIFFGetField( tif_in, TIFFTAG_ROWSPERSTRIP, &conv->rps );
 
-    uint32_t width = 0, height = 0, bpp = 0, spp = 0, rps = 0;
-    uint64_t exif_dir_offset = 0;
+    struct stat st = { 0 };
+    stat( input, &st );
+    set_datetime( conv, st.st_mtime );
 
-    int cfa = CFA_RGGB;
-    if( argc > 3 ) // runtime-specified CFA pattern (useful if the image is flipped/rotated)
-        cfa = atoi( argv[3] );
-    if( cfa > 3 || cfa < 0 )
-        goto usage;
+    // A mapped frame costs no memory of its own, so there's nothing to stream
+    if( !map_strips( conv, tif_in ) &&
+        (conv->opt->low_memory ? stream_scanlines( conv, tif_in, input ) : read_scanlines( conv, tif_in )) )
+        goto fail;
 
-    int compression = COMPRESSION_NONE;
-    if( argc > 4 )
-        compression = atoi( argv[4] );
-    if( compression != COMPRESSION_NONE && compression != COMPRESSION_JPEG &&
-        compression != COMPRESSION_ADOBE_DEFLATE )
-        goto usage;
+    status = 0;
+fail:
+    if( tif_in )
+        TIFFClose( tif_in );
+    return status;
+}
 
-    int frame = 0;
-    if( argc > 6 )
-        frame = atoi( argv[6] );
-    if( frame < 0 )
-        goto usage;
+// Take the next frame of a raw stream. Returns 0 at the end of the stream, -1 on errors.
+static int read_raw_frame( converter *conv, raw_stream *stream, const char *path, const uint32_t size[2], int frame )
+{
+    const size_t frame_size = raw_stream_frame_size( stream );
+
+    unmap_input( conv );
+    conv->frame = frame;
+    conv->streamed = 0;
+    conv->width = size[0];
+    conv->height = size[1];
+    conv->bpp = 16;
+    conv->spp = 1;
+    conv->rps = 0;
+
+    // Streamed frames are read into the frame buffer, mapped ones are used in place
+    if( frame_size > conv->buf_size )
+    {
+        _TIFFfree( conv->buf );
+        conv->buf_size = 0;
+        if( (conv->buf = _TIFFmalloc( frame_size )) == NULL )
+            return -1;
+        conv->buf_size = frame_size;
+    }
+    int ret = raw_stream_read( stream, conv->buf, &conv->image );
+    if( ret < 0 )
+        fprintf( stderr, "%s: unable to read frame %d\n", path, frame );
+    if( ret <= 0 )
+        return ret;
+
+    // There's no capture time in the stream, so use the file's or, for a pipe, now
+    struct stat st = { 0 };
+    set_datetime( conv, strcmp( path, "-" ) && !stat( path, &st ) ? st.st_mtime : time( NULL ) );
+    return 1;
+}
+
+// Shift samples whose significant bits are the top ones of each word down to the bottom,
+// copying a mapped frame into the frame buffer to do it. Fails if any of the bits shifted out were set.
+static int align_samples( converter *conv, const char *input )
+{
+    const int shift = 16 - sample_bits( conv->opt );
+    const size_t count = (size_t)conv->width * conv->height;
+    if( conv->image != conv->buf && count * 2 > conv->buf_size )
+    {
+        _TIFFfree( conv->buf );
+        conv->buf_size = 0;
+        if( (conv->buf = _TIFFmalloc( count * 2 )) == NULL )
+            return 1;
+        conv->buf_size = count * 2;
+    }
+
+    const uint16_t *src = (const uint16_t*)conv->image;
+    uint16_t *dst = (uint16_t*)conv->buf;
+    uint16_t any = 0;
+    for( size_t i = 0; i < count; i++ )
+    {
+        any |= src[i];
+        dst[i] = src[i] >> shift;
+    }
+    conv->image = conv->buf;
+    if( any & ((1u << shift) - 1) )
+    {
+        fprintf( stderr, "%s: samples have more than %d significant bits.\n", input, sample_bits( conv->opt ) );
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Compression is per IFD, so a frame is either all lossless JPEG or all uncompressed.
+ * Each tile gives up on LJ92 as soon as its histogram shows it won't save --min-gain,
+ * before writing any codes. If the frame as a whole doesn't save that much either,
+ * it's written uncompressed, which is smaller and costs nothing more to encode.
+ * Otherwise the tiles that gave up are encoded after all.
+ */
+static void choose_compression( converter *conv, tile_batch *batch, const char *input )
+{
+    const int64_t uncompressed = (int64_t)conv->width * conv->height * 2;
+    int64_t total = 0;
+    int gave_up = 0;
+    for( int i = 0; i < conv->tile_count; i++ )
+    {
+        // Anything else fails the frame in check_tiles
+        if( conv->tiles[i].status && conv->tiles[i].status != LJ92_ERROR_NO_GAIN )
+            return;
+        gave_up |= conv->tiles[i].status == LJ92_ERROR_NO_GAIN;
+        total += conv->tiles[i].length;
+    }
+    if( total > uncompressed * (100 - conv->opt->min_gain) / 100 )
+    {
+        if( conv->opt->report )
+            printf( "%s: lossless JPEG would take %lld bytes, written uncompressed\n", input, (long long)total );
+        conv->compression = COMPRESSION_NONE;
+        release_tiles( conv );
+        return;
+    }
+    if( gave_up )
+    {
+        batch->limit = 0;
+        batch->redo = 1;
+        tpool_run( conv->pool, conv->tile_count, encode_tile, batch );
+    }
+}
+
+// Compress the frame's tiles on the pool. Uncompressed frames are left as they are.
+static int encode_frame( converter *conv, const char *input )
+{
+    const dng_options *opt = conv->opt;
+    uint32_t tiles_across;
+
+    conv->compression = opt->compression;
+    // --low-memory frames were encoded as they were read
+    if( conv->streamed )
+        return check_tiles( conv, input );
+    conv->tile_count = 0;
+    if( opt->msb && sample_bits( opt ) < 16 && align_samples( conv, input ) )
+        return 1;
+    if( opt->compression == COMPRESSION_NONE )
+        return 0;
+    if( plan_tiles( conv, &tiles_across ) )
+        return 1;
+
+    // Each tile is compressed independently on the pool
+    tile_batch batch = { conv->pool, (const uint16_t*)conv->image, conv->width, conv->height, conv->tile_width, conv->tile_height,
+                         tiles_across, opt->compression, sample_bits( opt ), opt->reuse_tables, opt->predictor,
+                         (opt->restart + 1) / 2, opt->near_lossless, conv->tiles, conv->scratch, 1.0f / white_level( opt ), 0,
+                         (int)((int64_t)conv->tile_width * conv->tile_height * 2 * (100 - opt->min_gain) / 100), 0, 0, 0 };
+    tpool_run( conv->pool, conv->tile_count, encode_tile, &batch );
+    if( opt->compression == COMPRESSION_JPEG )
+        choose_compression( conv, &batch, input );
+    return check_tiles( conv, input );
+}
+
+// What a frame takes with each compression, in bytes of image data and seconds
+typedef struct
+{
+    int64_t ljpeg;
+    int64_t uncompressed;
+    int64_t deflate;
+    double read_seconds;
+    double ljpeg_seconds;   // Compressing alone
+    double deflate_seconds;
+    int64_t band_samples;   // Compressed for real to get the Deflate length and the times
+} size_estimate;
 
-    if( frame )
-    {
-        // Time code is an integer cast to a hex string for our purposes
-        // There's more to it in SMPTE 12M/309/331 if you want to get into drop-frame or date/time
-        // For example, to indicate 17 frames you write 0x17 (not 0x11)
-        char buf[5];
-        timecode[3] = (int)( frame / ( 3600 * framerate[0]/framerate[1] ) );
-        sprintf( buf, "0x%d", timecode[3] );
-        timecode[3] = (int)strtol( buf, NULL, 16 );
-        timecode[2] = (int)( frame / (   60 * framerate[0]/framerate[1] ) ) % 60;
-        sprintf( buf, "0x%d", timecode[2] );
-        timecode[2] = (int)strtol( buf, NULL, 16 );
-        timecode[1] = (int)( frame / (        framerate[0]/framerate[1] ) ) % 60;
-        sprintf( buf, "0x%d", timecode[1] );
-        timecode[1] = (int)strtol( buf, NULL, 16 );
-        timecode[0] = (int)fmod( frame, framerate[0]/framerate[1] );
-        sprintf( buf, "0x%d", timecode[0] );
-        timecode[0] = (int)strtol( buf, NULL, 16 );
+/*
+ * --estimate: work out the frame's size as lossless JPEG and Deflate with the tile and LJ92 options
+ * given, and how long compressing it would take. The LJ92 length comes from every ESTIMATE_ROW_STEP-th
+ * row predicted and counted. Then every ESTIMATE_BAND_STEP-th band of 16 rows is encoded as LJ92 and
+ * as Deflate, and their times, and the Deflate length, scaled up to all the rows of the tiles. More
+ * bands are taken until ESTIMATE_MIN_SAMPLES have been compressed over the run, so a single small
+ * frame still gets a fair sample. The bands taken move on with each frame by steps of the golden
+ * ratio, so over a batch they spread evenly down the frame, see encode_tile.
+ */
+static int estimate_frame( converter *conv, const char *input, const size_estimate *before, int sampled,
+                           size_estimate *size )
+{
+    const dng_options *opt = conv->opt;
+    const int compression[3] = { COMPRESSION_JPEG, COMPRESSION_JPEG, COMPRESSION_ADOBE_DEFLATE };
+    const int estimate[3] = { ESTIMATE_LENGTH, ESTIMATE_BANDS, ESTIMATE_BANDS };
+    uint32_t tiles_across;
+
+    if( opt->msb && sample_bits( opt ) < 16 && align_samples( conv, input ) )
+        return 1;
+    if( plan_tiles( conv, &tiles_across ) )
+        return 1;
+    size->uncompressed = (int64_t)conv->width * conv->height * 2;
+    const int bands = (int)((conv->tile_count / tiles_across) * conv->tile_height / 16);
+    const int64_t owed = ESTIMATE_MIN_SAMPLES - before->band_samples;
+    int band_step = owed > 0 ? (int)((int64_t)conv->tile_count * conv->tile_width * conv->tile_height / owed) : ESTIMATE_BAND_STEP;
+    band_step = band_step > ESTIMATE_BAND_STEP ? ESTIMATE_BAND_STEP : band_step > bands ? bands : band_step;
+    band_step = band_step < 1 ? 1 : band_step;
+    const double band_offset = fmod( 0.5 + sampled * 0.618034, 1.0 );
+    for( int c = 0; c < 3; c++ )
+    {
+        tile_batch batch = { conv->pool, (const uint16_t*)conv->image, conv->width, conv->height, conv->tile_width, conv->tile_height,
+                             tiles_across, compression[c], sample_bits( opt ), 0, opt->predictor,
+                             (opt->restart + 1) / 2, opt->near_lossless, conv->tiles, conv->scratch, 1.0f / white_level( opt ),
+                             estimate[c], 0, 0, band_step, band_offset };
+        const double start = clock_seconds();
+        tpool_run( conv->pool, conv->tile_count, encode_tile, &batch );
+        const double seconds = clock_seconds() - start;
+        int64_t length = 0, rows = 0;
+        for( int i = 0; i < conv->tile_count; i++ )
+        {
+            if( conv->tiles[i].status )
+            {
+                fprintf( stderr, "%s: unable to estimate tile data.\n", input );
+                release_tiles( conv );
+                return 1;
+            }
+            length += conv->tiles[i].length;
+            rows += conv->tiles[i].rows;
+        }
+        // Every column of tiles samples some band, as the step is at most the bands down the frame
+        const double scale = (double)conv->tile_count * conv->tile_height / (rows ? rows : 1);
+        if( estimate[c] == ESTIMATE_LENGTH )
+            size->ljpeg = length;
+        else if( compression[c] == COMPRESSION_JPEG )
+            size->ljpeg_seconds = seconds * scale;
+        else
+        {
+            size->deflate = (int64_t)(length * scale);
+            size->deflate_seconds = seconds * scale;
+            size->band_samples = rows * conv->tile_width;
+        }
     }
+    release_tiles( conv );
+    return 0;
+}
+
+// Write the DNG for an encoded frame. The tiles are released either way.
+static int write_frame( converter *conv, const char *output )
+{
+    const dng_options *opt = conv->opt;
+    const int compression = conv->compression;
+    int status = 1;
+    int ret = 0;
+    uint8_t timecode[8] = { 0 };
+    dng_ifd ifd, exif;
+    dng_chunk *chunks = NULL;
+    int chunk_count = 0;
+
+    dng_ifd_init( &ifd );
+    dng_ifd_init( &exif );
+
+    if( conv->frame )
+        frame_timecode( conv->frame, timecode );
 
     const uint8_t version4[] = "\01\04\00\00";
     const uint8_t version2[] = "\01\02\00\00";
@@ -193,188 +1091,873 @@ int main( int argc, char **argv )
 
     uint8_t uuid[16] = { 0 };
     char uuid_str[33] = { 0 };
-    prng_get_bytes( uuid, sizeof( uuid ) );
-    uuid[6] &= 0x0F;
-    uuid[6] |= ((4 << 4) & 0xF0); // version 4
-    uuid[8] &= 0x3F;
-    uuid[8] |= ((2 << 6) & 0xC0); // variant 2
-    sprintf( uuid_str, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-        uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
-        uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15] );
+    make_uuid( &conv->rng, uuid, uuid_str );
+
+    ret |= dng_set( &ifd, TIFFTAG_DNGVERSION, DNG_BYTE, 4, version );
+    ret |= dng_set( &ifd, TIFFTAG_DNGBACKWARDVERSION, DNG_BYTE, 4, version );
+    ret |= dng_set_long( &ifd, TIFFTAG_SUBFILETYPE, 0 );
+    ret |= dng_set_long( &ifd, TIFFTAG_IMAGEWIDTH, conv->width );
+    ret |= dng_set_long( &ifd, TIFFTAG_IMAGELENGTH, conv->height );
+    // Lossless JPEG is encoded at the samples' own precision, the others keep 16-bit words
+    ret |= dng_set_short( &ifd, TIFFTAG_BITSPERSAMPLE, compression == COMPRESSION_JPEG ? sample_bits( opt ) : conv->bpp );
+    ret |= dng_set_short( &ifd, TIFFTAG_COMPRESSION, compression );
+    ret |= dng_set_short( &ifd, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA );
+    ret |= dng_set_short( &ifd, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB );
+    ret |= dng_set_ascii( &ifd, TIFFTAG_MAKE, compression == COMPRESSION_JPEG ? "Canon" : "Point Grey" ); // hack to enable LJ92 mode in RawTherapee
+    ret |= dng_set_ascii( &ifd, TIFFTAG_MODEL, "BFLY-U3-23S6C-C" );
+    ret |= dng_set_short( &ifd, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT );
+    ret |= dng_set_short( &ifd, TIFFTAG_SAMPLESPERPIXEL, conv->spp );
+    ret |= dng_set_rational( &ifd, TIFFTAG_XRESOLUTION, DNG_RATIONAL, 1, &resolution );
+    ret |= dng_set_rational( &ifd, TIFFTAG_YRESOLUTION, DNG_RATIONAL, 1, &resolution );
+    ret |= dng_set_short( &ifd, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+    ret |= dng_set_short( &ifd, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH );
+    ret |= dng_set_ascii( &ifd, TIFFTAG_SOFTWARE, "makeDNG 0.3" );
+    ret |= dng_set_ascii( &ifd, TIFFTAG_DATETIME, conv->datetime );
+    ret |= dng_set_short( &ifd, TIFFTAG_SAMPLEFORMAT, sampleformat );
+    if( white_level( opt ) != 65535 )
+        ret |= dng_set_long( &ifd, TIFFTAG_WHITELEVEL, white_level( opt ) );
+    ret |= dng_set( &ifd, TIFFTAG_CFAREPEATPATTERNDIM, DNG_SHORT, 2, cfa_dimensions );
+    ret |= dng_set( &ifd, TIFFTAG_CFAPATTERN, DNG_BYTE, 4, cfa_patterns[opt->cfa] );
+    ret |= dng_set_ascii( &ifd, TIFFTAG_UNIQUECAMERAMODEL, "Point Grey Blackfly U3-23S6C-C" );
+    ret |= dng_set( &ifd, TIFFTAG_CFAPLANECOLOR, DNG_BYTE, 3, "\00\01\02" ); // RGB
+    ret |= dng_set_short( &ifd, TIFFTAG_CFALAYOUT, 1 ); // rectangular or square (not staggered)
+    ret |= dng_set_rational( &ifd, TIFFTAG_COLORMATRIX1, DNG_SRATIONAL, 9, cm1 );
+    // ret |= dng_set_rational( &ifd, TIFFTAG_COLORMATRIX2, DNG_SRATIONAL, 9, cm2 );
+    ret |= dng_set_rational( &ifd, TIFFTAG_ANALOGBALANCE, DNG_RATIONAL, 3, balance );
+    ret |= dng_set_rational( &ifd, TIFFTAG_ASSHOTNEUTRAL, DNG_RATIONAL, 3, as_shot );
+    ret |= dng_set_ascii( &ifd, TIFFTAG_CAMERASERIALNUMBER, "15187959" );
+    ret |= dng_set_short( &ifd, TIFFTAG_CALIBRATIONILLUMINANT1, illuminant1 );
+    // ret |= dng_set_short( &ifd, TIFFTAG_CALIBRATIONILLUMINANT2, illuminant2 );
+    ret |= dng_set( &ifd, TIFFTAG_RAWDATAUNIQUEID, DNG_BYTE, 16, uuid );
+    ret |= dng_set_rational( &ifd, TIFFTAG_FORWARDMATRIX1, DNG_SRATIONAL, 9, fm1 );
+    // ret |= dng_set_rational( &ifd, TIFFTAG_FORWARDMATRIX2, DNG_SRATIONAL, 9, fm2 );
+    if( conv->frame )
+    {
+        const float rate = framerate[0] / framerate[1];
+        ret |= dng_set( &ifd, TIFFTAG_TIMECODES, DNG_BYTE, 8, timecode );
+        ret |= dng_set_rational( &ifd, TIFFTAG_FRAMERATE, DNG_SRATIONAL, 1, &rate );
+    }
+    if( opt->reelname )
+        ret |= dng_set_ascii( &ifd, TIFFTAG_REELNAME, opt->reelname );
+
+    const float focal_length = 107.0f;
+    const float exposure = exposure_time[0] / exposure_time[1];
+    const float fnumber = f_number;
+    const float shutter_speed = log2( exposure_time[0] / exposure_time[1] ) * -1;
+    const float aperture = log2( f_number * f_number );
+    ret |= dng_set_rational( &exif, EXIFTAG_FOCALLENGTH, DNG_RATIONAL, 1, &focal_length );
+    ret |= dng_set_rational( &exif, EXIFTAG_EXPOSURETIME, DNG_RATIONAL, 1, &exposure );
+    ret |= dng_set_rational( &exif, EXIFTAG_FNUMBER, DNG_RATIONAL, 1, &fnumber );
+    ret |= dng_set( &exif, EXIFTAG_ISOSPEEDRATINGS, DNG_SHORT, 1, isospeed );
+    ret |= dng_set_short( &exif, EXIFTAG_EXPOSUREPROGRAM, 1 ); // manual
+    ret |= dng_set_ascii( &exif, EXIFTAG_DATETIMEORIGINAL, conv->datetime );
+    ret |= dng_set_ascii( &exif, EXIFTAG_DATETIMEDIGITIZED, conv->datetime );
+    ret |= dng_set_rational( &exif, EXIFTAG_SHUTTERSPEEDVALUE, DNG_SRATIONAL, 1, &shutter_speed );
+    ret |= dng_set_rational( &exif, EXIFTAG_APERTUREVALUE, DNG_RATIONAL, 1, &aperture );
+    ret |= dng_set_short( &exif, EXIFTAG_FLASH, 32 ); // no flash function
+    ret |= dng_set_short( &exif, EXIFTAG_SENSINGMETHOD, 2 );
+    ret |= dng_set_ascii( &exif, EXIFTAG_IMAGEUNIQUEID, uuid_str );
+    ret |= dng_set( &exif, EXIFTAG_TIFFEPSTANDARDID, DNG_BYTE, 4, "\01\00\00\00" );
+    ret |= dng_set_ascii( &exif, EXIFTAG_LENSMAKE, "Minolta" );
+    ret |= dng_set_ascii( &exif, EXIFTAG_LENSMODEL, "M5400 36mm f/2.5" );
+    ret |= dng_set_ascii( &exif, EXIFTAG_LENSSERIALNUMBER, "20401326" );
 
-    augment_libtiff_with_custom_tags();
-    TIFF *tif = 0, *tif_in = 0;
+    if( compression == COMPRESSION_NONE )
+    {
+        // The pixels are already what goes in the file, so they're written as
+        // whole strips straight from the frame buffer or the mapped input
+        const uint32_t row_size = conv->width * 2;
+        uint32_t rps = conv->rps;
+        if( !rps || rps > conv->height )
+            rps = conv->height;
+        ret |= dng_set_long( &ifd, TIFFTAG_ROWSPERSTRIP, rps );
+        if( (chunks = malloc( ((conv->height + rps - 1) / rps) * sizeof( dng_chunk ) )) == NULL )
+            goto fail;
+        for( uint32_t row = 0; row < conv->height; row += rps, chunk_count++ )
+        {
+            const uint32_t rows = conv->height - row < rps ? conv->height - row : rps;
+            chunks[chunk_count].data = conv->image + (size_t)row * row_size;
+            chunks[chunk_count].length = rows * row_size;
+        }
+    }
+    else
+    {
+        ret |= dng_set_long( &ifd, TIFFTAG_TILEWIDTH, conv->tile_width );
+        ret |= dng_set_long( &ifd, TIFFTAG_TILELENGTH, conv->tile_height );
+        if( compression == COMPRESSION_ADOBE_DEFLATE )
+            ret |= dng_set_short( &ifd, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT );
+        if( (chunks = malloc( conv->tile_count * sizeof( dng_chunk ) )) == NULL )
+            goto fail;
+        for( ; chunk_count < conv->tile_count; chunk_count++ )
+        {
+            chunks[chunk_count].data = conv->tiles[chunk_count].data;
+            chunks[chunk_count].length = conv->tiles[chunk_count].length;
+        }
+    }
+    if( ret )
+        goto fail;
 
-    if( (tif_in = TIFFOpen( argv[1], "r" )) == NULL )
+    if( dng_write( output, &ifd, &exif, compression != COMPRESSION_NONE, chunks, chunk_count ) )
     {
-        perror( argv[1] );
+        perror( output );
         goto fail;
     }
 
-    if( (tif = TIFFOpen( argv[2], "w" )) == NULL )
+    status = 0;
+fail:
+    free( chunks );
+    dng_ifd_free( &exif );
+    dng_ifd_free( &ifd );
+    release_tiles( conv );
+    return status;
+}
+
+static int convert_frame( converter *conv, const char *input, const char *output, int frame )
+{
+    if( read_frame( conv, input, frame ) || encode_frame( conv, input ) )
+        return 1;
+    return write_frame( conv, output );
+}
+
+// Seed a converter's prng from the global one. Only call this before the worker threads start.
+static void seed_converter( converter *conv )
+{
+    uint8_t key[256];
+    prng_get_bytes( key, sizeof( key ) );
+    prng_r_seed_bytes( &conv->rng, key, sizeof( key ) );
+}
+
+static void free_converter( converter *conv )
+{
+    unmap_input( conv );
+    _TIFFfree( conv->buf );
+    for( int i = 0; i < conv->tiles_size; i++ )
+        free( conv->tiles[i].data );
+    free( conv->tiles );
+    for( int i = 0; i < conv->streams_size; i++ )
+        lj92_encoder_destroy( conv->streams[i] );
+    free( conv->streams );
+}
+
+// Outputs of an ordered batch are written under a hidden name in the same directory, then renamed into place
+static void temporary_name( char *temp, size_t size, const char *output )
+{
+    const char *base = strrchr( output, '/' );
+#ifdef _WIN32
+    const char *backslash = strrchr( output, '\\' );
+    if( backslash > base )
+        base = backslash;
+#endif
+    base = base ? base + 1 : output;
+    snprintf( temp, size, "%.*s.%s.part", (int)(base - output), output, base );
+}
+
+static void frame_names( const frame_batch *batch, int i, char *output, size_t size, char *temp, size_t temp_size )
+{
+    snprintf( output, size, batch->output_pattern, batch->start_frame + i );
+    if( batch->ordered )
+        temporary_name( temp, temp_size, output );
+}
+
+// Rename every written frame that has no gap before it. Called with the batch lock held.
+static void finalize_frames( frame_batch *batch )
+{
+    char output[4096], temp[4096 + 8];
+    while( batch->finalize < batch->first_failure && batch->written[batch->finalize] )
+    {
+        frame_names( batch, batch->finalize, output, sizeof( output ), temp, sizeof( temp ) );
+#ifdef _WIN32
+        remove( output );
+#endif
+        if( rename( temp, output ) )
+        {
+            perror( output );
+            batch->first_failure = batch->finalize;
+            break;
+        }
+        batch->written[batch->finalize++] = 0;
+    }
+}
+
+// Convert one input, then start the next so the number of frames in flight stays at the
+// number of converters. Nothing here blocks, as this may run nested inside another frame
+// that is waiting on its tiles.
+static void frame_task( void *arg, int i )
+{
+    frame_batch *batch = arg;
+    char output[4096], temp[4096 + 8];
+    int status = 1;
+
+    mutex_lock( &batch->lock );
+    converter *conv = batch->idle[--batch->idle_count];
+    const int abandoned = i >= batch->first_failure;
+    mutex_unlock( &batch->lock );
+
+    if( !abandoned )
+    {
+        // Each frame gets the next frame number, which also drives its time code
+        frame_names( batch, i, output, sizeof( output ), temp, sizeof( temp ) );
+        status = convert_frame( conv, batch->inputs[i], batch->ordered ? temp : output, batch->start_frame + i );
+        if( status && batch->ordered )
+            remove( temp );
+    }
+
+    mutex_lock( &batch->lock );
+    batch->idle[batch->idle_count++] = conv;
+    if( status && i < batch->first_failure )
+        batch->first_failure = i;
+    if( batch->ordered && !status )
+    {
+        batch->written[i] = 1;
+        finalize_frames( batch );
+    }
+    if( batch->next < batch->first_failure )
+        tpool_spawn( batch->pool, &batch->frames, frame_task, batch, batch->next++ );
+    mutex_unlock( &batch->lock );
+}
+
+// A pipelined batch: a reader thread, the encoder on the calling thread and its pool, and
+// a writer thread, so the next frame is read and the last one written while this one is
+// compressed. Slots carry frames from stage to stage in sequence order and go back to the
+// reader once written.
+typedef struct
+{
+    converter conv;
+    int index;              // Input being carried
+    int status;
+} pipeline_slot;
+
+typedef struct
+{
+    frame_batch *batch;
+    fifo *spare;            // Writer -> reader
+    fifo *read;             // Reader -> encoder
+    fifo *encoded;          // Encoder -> writer
+    volatile long stop;     // Set by the writer after a failure
+} pipeline;
+
+static void reader_main( void *arg )
+{
+    pipeline *p = arg;
+    frame_batch *batch = p->batch;
+    int i = 0;
+    for( ; i < batch->count && !atomic_get( &p->stop ); i++ )
+    {
+        pipeline_slot *slot = fifo_pop( p->spare );
+        slot->index = i;
+        if( batch->stream )
+        {
+            int ret = read_raw_frame( &slot->conv, batch->stream, batch->stream_path, batch->stream_size,
+                                      batch->start_frame + i );
+            // Only the writer pushes to spare, and nothing pops it after this, so the slot is just dropped
+            if( ret == 0 )
+                break;
+            slot->status = ret < 0;
+        }
+        else
+            slot->status = read_frame( &slot->conv, batch->inputs[i], batch->start_frame + i );
+        fifo_push( p->read, slot );
+    }
+    // Nothing reads the count until the stages are joined
+    if( batch->stream && !atomic_get( &p->stop ) )
+        batch->count = i;
+    fifo_push( p->read, NULL );
+}
+
+static void writer_main( void *arg )
+{
+    pipeline *p = arg;
+    frame_batch *batch = p->batch;
+    char output[4096], temp[4096 + 8];
+    pipeline_slot *slot;
+    while( (slot = fifo_pop( p->encoded )) != NULL )
+    {
+        if( slot->status || atomic_get( &p->stop ) )
+            release_tiles( &slot->conv );
+        else
+        {
+            frame_names( batch, slot->index, output, sizeof( output ), temp, sizeof( temp ) );
+            slot->status = write_frame( &slot->conv, batch->ordered ? temp : output );
+            if( batch->ordered )
+            {
+#ifdef _WIN32
+                remove( output );
+#endif
+                if( !slot->status && rename( temp, output ) )
+                {
+                    perror( output );
+                    slot->status = 1;
+                }
+                if( slot->status )
+                    remove( temp );
+            }
+        }
+        // Frames arrive in order, so the first failure seen is the first in the batch
+        if( slot->status && !atomic_get( &p->stop ) )
+        {
+            batch->first_failure = slot->index;
+            atomic_add( &p->stop, 1 );
+        }
+        fifo_push( p->spare, slot );
+    }
+}
+
+// read_depth and write_depth are the frames allowed to queue up in front of the encoder
+// and the writer. One more frame can be in each stage.
+static int run_pipeline( frame_batch *batch, const dng_options *opt, int threads, int read_depth, int write_depth )
+{
+    const int slot_count = read_depth + write_depth + 3;
+    int status = 1;
+    pipeline p = { batch, fifo_create( slot_count ), fifo_create( read_depth ), fifo_create( write_depth ), 0 };
+    pipeline_slot *slots = calloc( slot_count, sizeof( pipeline_slot ) );
+    tpool *pool = tpool_create( threads );
+    tile_scratch *scratch = pool ? create_scratch( pool ) : NULL;
+    thread_t reader, writer;
+
+    if( !p.spare || !p.read || !p.encoded || !slots || !scratch )
+    {
+        fprintf( stderr, "Unable to create worker threads.\n" );
+        goto fail;
+    }
+    for( int i = 0; i < slot_count; i++ )
     {
-        perror( argv[1] );
+        slots[i].conv.opt = opt;
+        slots[i].conv.pool = pool;
+        slots[i].conv.scratch = scratch;
+        seed_converter( &slots[i].conv );
+        fifo_push( p.spare, &slots[i] );
+    }
+    if( thread_create( &reader, reader_main, &p ) )
+    {
+        fprintf( stderr, "Unable to create worker threads.\n" );
         goto fail;
     }
+    if( thread_create( &writer, writer_main, &p ) )
+    {
+        // The reader needs somewhere to put its frames before it can be joined
+        atomic_add( &p.stop, 1 );
+        while( fifo_pop( p.read ) != NULL )
+            ;
+        thread_join( reader );
+        fprintf( stderr, "Unable to create worker threads.\n" );
+        goto fail;
+    }
+
+    pipeline_slot *slot;
+    while( (slot = fifo_pop( p.read )) != NULL )
+    {
+        if( !slot->status && !atomic_get( &p.stop ) )
+            slot->status = encode_frame( &slot->conv, batch->stream ? batch->stream_path : batch->inputs[slot->index] );
+        fifo_push( p.encoded, slot );
+    }
+    fifo_push( p.encoded, NULL );
+    thread_join( reader );
+    thread_join( writer );
+    status = batch->first_failure < batch->count;
 
-    TIFFGetField( tif_in, TIFFTAG_IMAGEWIDTH, &width );
-    TIFFGetField( tif_in, TIFFTAG_IMAGELENGTH, &height );
-    TIFFGetField( tif_in, TIFFTAG_BITSPERSAMPLE, &bpp );
-    TIFFGetField( tif_in, TIFFTAG_SAMPLESPERPIXEL, &spp );
-    TIFFGetField( tif_in, TIFFTAG_ROWSPERSTRIP, &rps );
+fail:
+    if( slots )
+    {
+        for( int i = 0; i < slot_count; i++ )
+            free_converter( &slots[i].conv );
+        free( slots );
+    }
+    if( pool )
+        free_scratch( scratch, pool );
+    tpool_destroy( pool );
+    fifo_destroy( p.encoded );
+    fifo_destroy( p.read );
+    fifo_destroy( p.spare );
+    return status;
+}
 
-    struct stat st = { 0 };
-    struct tm *tm = { 0 };
-    char datetime[20] = { 0 };
-    stat( argv[1], &st );
-    tm = gmtime( &st.st_mtime );
-    snprintf( datetime, sizeof( datetime ), "%04d:%02d:%02d %02d:%02d:%02d",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec );
+// Megabytes of frame data a second, and frames a second, from the time the sampled frames took
+static void print_speed( const size_estimate *total, int sampled, double seconds )
+{
+    if( seconds > 0 )
+        printf( "  %7.1f MB/s  %6.1f frames/s\n", total->uncompressed / seconds / 1e6, sampled / seconds );
+    else
+        printf( "\n" );
+}
 
-    const uint32_t halfwidth = width / 2;
-    if( halfwidth % 16 || height % 16 )
+/*
+ * --estimate: work out what every Nth frame of a batch or stream would take with
+ * each compression, and project the totals over all of them, without writing
+ * anything. The sampled frames go one at a time with their tiles on the pool.
+ * The speed of each compression is projected from the time reading the sampled
+ * frames took plus the time their compression would, see estimate_frame.
+ */
+static int run_estimate( frame_batch *batch, const dng_options *opt, int threads )
+{
+    int status = 1;
+    int frames = 0, sampled = 0;
+    size_estimate total = { 0 };
+    converter conv = { 0 };
+    const double start = clock_seconds();
+
+    conv.opt = opt;
+    if( (conv.pool = tpool_create( threads )) == NULL || (conv.scratch = create_scratch( conv.pool )) == NULL )
     {
-        fprintf( stderr, "Tile dimensions must be a multiple of 16.\n" );
+        fprintf( stderr, "Unable to create worker threads.\n" );
         goto fail;
     }
+    for( int i = 0; i < batch->count; i++ )
+    {
+        const char *input = batch->stream ? batch->stream_path : batch->inputs[i];
+        const int sample = i % opt->estimate == 0;
+        const double read_start = clock_seconds();
+        if( batch->stream )
+        {
+            // Frames of a stream have to be read to get past them
+            int ret = read_raw_frame( &conv, batch->stream, batch->stream_path, batch->stream_size, batch->start_frame + i );
+            if( ret < 0 )
+                goto fail;
+            if( ret == 0 )
+                break;
+        }
+        else if( sample && read_frame( &conv, input, batch->start_frame + i ) )
+            goto fail;
+        frames++;
+        if( !sample )
+            continue;
 
-    TIFFSetField( tif, TIFFTAG_DNGVERSION, version );
-    TIFFSetField( tif, TIFFTAG_DNGBACKWARDVERSION, version );
-    TIFFSetField( tif, TIFFTAG_SUBFILETYPE, 0 );
-    TIFFSetField( tif, TIFFTAG_IMAGEWIDTH, width );
-    TIFFSetField( tif, TIFFTAG_IMAGELENGTH, height );
-    TIFFSetField( tif, TIFFTAG_BITSPERSAMPLE, bpp );
-    TIFFSetField( tif, TIFFTAG_COMPRESSION, compression );
-    TIFFSetField( tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA );
-    TIFFSetField( tif, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB );
-    TIFFSetField( tif, TIFFTAG_MAKE, compression == COMPRESSION_JPEG ? "Canon" : "Point Grey" ); // hack to enable LJ92 mode in RawTherapee
-    TIFFSetField( tif, TIFFTAG_MODEL, "BFLY-U3-23S6C-C" );
-    TIFFSetField( tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT );
-    TIFFSetField( tif, TIFFTAG_SAMPLESPERPIXEL, spp );
-    TIFFSetField( tif, TIFFTAG_XRESOLUTION, resolution );
-    TIFFSetField( tif, TIFFTAG_YRESOLUTION, resolution );
-    TIFFSetField( tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
-    TIFFSetField( tif, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH );
-    TIFFSetField( tif, TIFFTAG_SOFTWARE, "makeDNG 0.3" );
-    TIFFSetField( tif, TIFFTAG_DATETIME, datetime );
-    TIFFSetField( tif, TIFFTAG_SAMPLEFORMAT, sampleformat );
-    TIFFSetField( tif, TIFFTAG_CFAREPEATPATTERNDIM, cfa_dimensions );
-
-#if TIFFLIB_VERSION >= 20201219
-    /*
-        The arguments for TIFFTAG_CFAPATTERN changed in tifflib 4.2.0 per
-        https://gitlab.com/libtiff/libtiff/-/issues/58
-        In newer versions we need to specify the number of elements in the pattern array.
-        The number above is TIFFLIB_VERSION in tiffvers.h v4.2.0
-    */
-    TIFFSetField( tif, TIFFTAG_CFAPATTERN, 4, cfa_patterns[cfa] );
-#else
-    TIFFSetField( tif, TIFFTAG_CFAPATTERN, cfa_patterns[cfa] );
-#endif
-    TIFFSetField( tif, TIFFTAG_UNIQUECAMERAMODEL, "Point Grey Blackfly U3-23S6C-C" );
-    TIFFSetField( tif, TIFFTAG_CFAPLANECOLOR, 3, "\00\01\02" ); // RGB
-    TIFFSetField( tif, TIFFTAG_CFALAYOUT, 1 ); // rectangular or square (not staggered)
-    TIFFSetField( tif, TIFFTAG_COLORMATRIX1, 9, cm1 );
-    // TIFFSetField( tif, TIFFTAG_COLORMATRIX2, 9, cm2 );
-    TIFFSetField( tif, TIFFTAG_ANALOGBALANCE, 3, balance );
-    TIFFSetField( tif, TIFFTAG_ASSHOTNEUTRAL, 3, as_shot );
-    TIFFSetField( tif, TIFFTAG_CAMERASERIALNUMBER, "15187959" );
-    TIFFSetField( tif, TIFFTAG_CALIBRATIONILLUMINANT1, illuminant1 );
-    // TIFFSetField( tif, TIFFTAG_CALIBRATIONILLUMINANT2, illuminant2 );
-    TIFFSetField( tif, TIFFTAG_RAWDATAUNIQUEID, uuid );
-    TIFFSetField( tif, TIFFTAG_FORWARDMATRIX1, 9, fm1 );
-    // TIFFSetField( tif, TIFFTAG_FORWARDMATRIX2, 9, fm2 );
-    if( frame )
-    {
-        TIFFSetField( tif, TIFFTAG_TIMECODES, 8, timecode );
-        TIFFSetField( tif, TIFFTAG_FRAMERATE, 2, framerate );
-    }
-    if( argc > 5 )
-        TIFFSetField( tif, TIFFTAG_REELNAME, argv[5] );
-
-    uint8_t* buf = 0;
-    buf = _TIFFmalloc( TIFFScanlineSize( tif_in ) * height );
+        size_estimate size = { 0 };
+        size.read_seconds = clock_seconds() - read_start;
+        if( estimate_frame( &conv, input, &total, sampled, &size ) )
+            goto fail;
+        printf( "%s: frame %d, lossless JPEG %lld, uncompressed %lld, Deflate %lld bytes\n", input, batch->start_frame + i,
+                (long long)size.ljpeg, (long long)size.uncompressed, (long long)size.deflate );
+        total.ljpeg += size.ljpeg;
+        total.uncompressed += size.uncompressed;
+        total.deflate += size.deflate;
+        total.read_seconds += size.read_seconds;
+        total.ljpeg_seconds += size.ljpeg_seconds;
+        total.deflate_seconds += size.deflate_seconds;
+        total.band_samples += size.band_samples;
+        sampled++;
+    }
 
-    for( uint32_t row = 0; row < height; row++ )
-        TIFFReadScanline( tif_in, &buf[row * width * 2], row, 0 );
+    // The frames that weren't sampled are taken to be like the ones that were
+    if( sampled )
+    {
+        printf( "%d of %d frames sampled in %.2f s, projected for all of them, with the speed of reading and compressing:\n",
+                sampled, frames, clock_seconds() - start );
+        printf( "  lossless JPEG  %15lld bytes  %5.1f%%", (long long)(total.ljpeg * frames / sampled),
+                100.0 * total.ljpeg / total.uncompressed );
+        print_speed( &total, sampled, total.read_seconds + total.ljpeg_seconds );
+        printf( "  uncompressed   %15lld bytes  100.0%%", (long long)(total.uncompressed * frames / sampled) );
+        print_speed( &total, sampled, total.read_seconds );
+        printf( "  Deflate        %15lld bytes  %5.1f%%", (long long)(total.deflate * frames / sampled),
+                100.0 * total.deflate / total.uncompressed );
+        print_speed( &total, sampled, total.read_seconds + total.deflate_seconds );
+    }
+    status = 0;
+fail:
+    free_scratch( conv.scratch, conv.pool );
+    tpool_destroy( conv.pool );
+    free_converter( &conv );
+    return status;
+}
 
-    if( compression == COMPRESSION_NONE )
+// Accept output patterns with exactly one integer conversion for the frame number, like "reel_%06d.dng"
+static int check_output_pattern( const char *pattern )
+{
+    int conversions = 0;
+    for( const char *p = pattern; *p; p++ )
+    {
+        if( *p != '%' )
+            continue;
+        if( *++p == '%' )
+            continue;
+        while( *p == '0' || *p == '-' || *p == '+' || *p == ' ' )
+            p++;
+        while( *p >= '0' && *p <= '9' )
+            p++;
+        if( *p != 'd' && *p != 'i' && *p != 'u' )
+            return 0;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+static char *copy_string( const char *s )
+{
+    size_t n = strlen( s ) + 1;
+    char *copy = malloc( n );
+    if( copy )
+        memcpy( copy, s, n );
+    return copy;
+}
+
+// Read the inputs of a batch, one path per line from a list file ("-" for stdin), or expand a glob pattern
+static char **read_input_list( const char *list, int *count )
+{
+    char **paths = NULL;
+    int n = 0, size = 0;
+    FILE *f = strcmp( list, "-" ) ? fopen( list, "r" ) : stdin;
+
+#ifndef _WIN32
+    if( !f && strpbrk( list, "*?[" ) )
     {
-        if( rps )
-            TIFFSetField( tif, TIFFTAG_ROWSPERSTRIP, rps );
-        for( uint32_t row = 0; row < height; row++ )
-            TIFFWriteScanline( tif, &buf[row * width * 2], row, 0 );
-    }
-    else if( compression == COMPRESSION_ADOBE_DEFLATE )
-    {
-        TIFFSetField( tif, TIFFTAG_TILEWIDTH, halfwidth );
-        TIFFSetField( tif, TIFFTAG_TILELENGTH, height );
-        TIFFSetField( tif, TIFFTAG_ZIPQUALITY, 9 );
-        TIFFSetField( tif, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT );
-        uint16_t* buf1 = _TIFFmalloc( TIFFScanlineSize( tif_in ) * height / 2 );
-        uint16_t* buf2 = _TIFFmalloc( TIFFScanlineSize( tif_in ) * height / 2 );
-        const float_t scale = 1.0f / 65535.0f;
-        uint16_t* buf16 = (uint16_t*)buf;
-        for( uint32_t row = 0; row < height; row++ )
+        glob_t g;
+        if( glob( list, 0, NULL, &g ) )
+            return NULL;
+        if( (paths = malloc( g.gl_pathc * sizeof( char* ) )) != NULL )
         {
-            for( uint32_t i = 0; i < halfwidth; i++ )
-                buf1[row * halfwidth + i] = DNG_FloatToHalf( float_bits( buf16[row * width + i] * scale ) );
-            for( uint32_t i = halfwidth; i < width; i++ )
-                buf2[row * halfwidth + i - halfwidth] = DNG_FloatToHalf( float_bits( buf16[row * width + i] * scale ) );
+            for( size_t i = 0; i < g.gl_pathc; i++ )
+                paths[n++] = copy_string( g.gl_pathv[i] );
         }
-        TIFFWriteTile( tif, buf1, 0, 0, 0, sizeof( buf1 ) );
-        TIFFWriteTile( tif, buf2, halfwidth, 0, 0, sizeof( buf2 ) );
-        _TIFFfree( buf1 );
-        _TIFFfree( buf2 );
-    }
-    else if( compression == COMPRESSION_JPEG )
-    {
-        TIFFSetField( tif, TIFFTAG_TILEWIDTH, halfwidth );
-        TIFFSetField( tif, TIFFTAG_TILELENGTH, height );
-        int ret = 0;
-        uint8_t* input = buf;
-        uint8_t* encoded = NULL;
-        int encodedLength = 0;
-        ret = lj92_encode( (uint16_t*)&input[0], halfwidth, height, 16, halfwidth, halfwidth, NULL, 0, &encoded, &encodedLength );
-        TIFFWriteRawTile( tif, 0, encoded, encodedLength );
-        free( encoded );
-        ret = lj92_encode( (uint16_t*)&input[width], halfwidth, height, 16, halfwidth, halfwidth, NULL, 0, &encoded, &encodedLength );
-        TIFFWriteRawTile( tif, 1, encoded, encodedLength );
-        free( encoded );
-    }
-
-    TIFFWriteDirectory( tif );
-    TIFFCreateEXIFDirectory( tif );
-    TIFFSetField( tif, EXIFTAG_FOCALLENGTH, 107.0f );
-    TIFFSetField( tif, EXIFTAG_EXPOSURETIME, exposure_time[0] / exposure_time[1] );
-    TIFFSetField( tif, EXIFTAG_FNUMBER, f_number );
-    TIFFSetField( tif, EXIFTAG_ISOSPEEDRATINGS, 1, isospeed );
-    TIFFSetField( tif, EXIFTAG_EXPOSUREPROGRAM, 1 ); // manual
-    TIFFSetField( tif, EXIFTAG_DATETIMEORIGINAL, datetime );
-    TIFFSetField( tif, EXIFTAG_DATETIMEDIGITIZED, datetime );
-    TIFFSetField( tif, EXIFTAG_SHUTTERSPEEDVALUE, log2( exposure_time[0] / exposure_time[1] ) * -1 );
-    TIFFSetField( tif, EXIFTAG_APERTUREVALUE, log2( f_number * f_number ) );
-    TIFFSetField( tif, EXIFTAG_FLASH, 32 ); // no flash function
-    TIFFSetField( tif, EXIFTAG_SENSINGMETHOD, 2 );
-    TIFFSetField( tif, EXIFTAG_IMAGEUNIQUEID, uuid_str );
-#ifdef HAVE_CUSTOM_EXIFTAGS
-    TIFFSetField( tif, EXIFTAG_TIFFEPSTANDARDID, "\01\00\00\00" );
-    TIFFSetField( tif, EXIFTAG_LENSMAKE, "Minolta" );
-    TIFFSetField( tif, EXIFTAG_LENSMODEL, "M5400 36mm f/2.5" );
-    TIFFSetField( tif, EXIFTAG_LENSSERIALNUMBER, "20401326" );
+        globfree( &g );
+        *count = n;
+        return paths;
+    }
 #endif
-    TIFFWriteCustomDirectory( tif, &exif_dir_offset );
-    TIFFSetDirectory( tif, 0 );
-    TIFFSetField( tif, TIFFTAG_EXIFIFD, exif_dir_offset );
+    if( !f )
+    {
+        perror( list );
+        return NULL;
+    }
 
-    _TIFFfree( buf );
-    TIFFClose( tif_in );
-    TIFFClose( tif );
-    status = 0;
+    char line[4096];
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        line[strcspn( line, "\r\n" )] = 0;
+        if( !line[0] )
+            continue;
+        if( n == size )
+        {
+            size = size ? size * 2 : 256;
+            char **grown = realloc( paths, size * sizeof( char* ) );
+            if( !grown )
+                break;
+            paths = grown;
+        }
+        paths[n++] = copy_string( line );
+    }
+    if( f != stdin )
+        fclose( f );
+    *count = n;
+    return paths;
+}
+
+int main( int argc, char **argv )
+{
+    int status = 1;
+    int threads = 0;
+    const char *batch_list = NULL, *output_pattern = NULL, *stream_path = NULL;
+    uint32_t raw_size[2] = { 0 };
+    int raw_bits = 0;
+    int start_frame = 1;
+    int jobs = 0, ordered = 0;
+    int read_depth = 0, write_depth = 0;
+    dng_options opt = { CFA_RGGB, COMPRESSION_NONE, NULL, 0, 0, 0, 0, 0, 6, 0, 0, 0, 0, 0, 0 };
+    char *args[6] = { 0 };
+    int nargs = 0;
+
+    // Options can go anywhere, everything else is positional
+    for( int i = 1; i < argc; i++ )
+    {
+        if( !strcmp( argv[i], "--threads" ) && i + 1 < argc )
+            threads = atoi( argv[++i] );
+        else if( !strcmp( argv[i], "--tile" ) && i + 1 < argc )
+        {
+            // Tile dimensions have to be multiples of 16 per TIFF 6.0
+            if( sscanf( argv[++i], "%ux%u", &opt.tile_width, &opt.tile_height ) != 2 ||
+                !opt.tile_width || !opt.tile_height || opt.tile_width % 16 || opt.tile_height % 16 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--batch" ) && i + 1 < argc )
+            batch_list = argv[++i];
+        else if( !strcmp( argv[i], "--output" ) && i + 1 < argc )
+            output_pattern = argv[++i];
+        else if( !strcmp( argv[i], "--start" ) && i + 1 < argc )
+            start_frame = atoi( argv[++i] );
+        else if( !strcmp( argv[i], "--jobs" ) && i + 1 < argc )
+            jobs = atoi( argv[++i] );
+        else if( !strcmp( argv[i], "--ordered" ) )
+            ordered = 1;
+        else if( !strcmp( argv[i], "--stream" ) && i + 1 < argc )
+            stream_path = argv[++i];
+        else if( !strcmp( argv[i], "--raw" ) && i + 1 < argc )
+        {
+            if( sscanf( argv[++i], "%ux%ux%d", &raw_size[0], &raw_size[1], &raw_bits ) != 3 ||
+                !raw_size[0] || !raw_size[1] || raw_bits < 1 || raw_bits > 16 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--bits" ) && i + 1 < argc )
+        {
+            // N:msb for samples whose significant bits are the top ones
+            char align[4] = { 0 };
+            int n = sscanf( argv[++i], "%d:%3s", &opt.bits, align );
+            if( n < 1 || opt.bits < 1 || opt.bits > 16 || (n == 2 && strcmp( align, "msb" )) )
+                goto usage;
+            opt.msb = n == 2;
+        }
+        else if( !strcmp( argv[i], "--predictor" ) && i + 1 < argc )
+        {
+            // auto tries all of them on a sample of each tile's rows
+            if( !strcmp( argv[++i], "auto" ) )
+                opt.predictor = 0;
+            else if( (opt.predictor = atoi( argv[i] )) < 1 || opt.predictor > 7 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--restart" ) && i + 1 < argc )
+        {
+            if( (opt.restart = atoi( argv[++i] )) < 1 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--near-lossless" ) && i + 1 < argc )
+        {
+            if( (opt.near_lossless = atoi( argv[++i] )) < 1 || opt.near_lossless > 15 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--low-memory" ) )
+            opt.low_memory = 1;
+        else if( !strcmp( argv[i], "--min-gain" ) && i + 1 < argc )
+        {
+            if( (opt.min_gain = atoi( argv[++i] )) < 0 || opt.min_gain > 99 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--estimate" ) && i + 1 < argc )
+        {
+            if( (opt.estimate = atoi( argv[++i] )) < 1 )
+                goto usage;
+        }
+        else if( !strcmp( argv[i], "--report" ) )
+            opt.report = 1;
+        else if( !strcmp( argv[i], "--pipeline" ) && i + 1 < argc )
+        {
+            if( sscanf( argv[++i], "%d:%d", &read_depth, &write_depth ) != 2 ||
+                read_depth < 1 || write_depth < 1 )
+                goto usage;
+        }
+        else if( !strncmp( argv[i], "--", 2 ) || nargs == 6 )
+            goto usage;
+        else
+            args[nargs++] = argv[i];
+    }
+    if( threads < 0 || start_frame < 0 || jobs < 0 ) goto usage;
+    // --bits overrides the BITS of --raw wherever it comes
+    if( !opt.bits )
+        opt.bits = raw_bits;
+    if( threads == 0 )
+        threads = cpu_count();
+
+    // A batch names its inputs and outputs with --batch or --stream and --output, so the positional arguments start at the CFA pattern.
+    // An estimate writes nothing, so it has no output.
+    char **pos = args + (opt.estimate ? 1 : 2);
+    int npos = nargs - (opt.estimate ? 1 : 2);
+    if( !stream_path != !raw_size[0] || (stream_path && batch_list) )
+        goto usage;
+    if( batch_list || stream_path )
+    {
+        if( (!output_pattern && !opt.estimate) || nargs > 3 )
+            goto usage;
+        if( output_pattern && !check_output_pattern( output_pattern ) )
+        {
+            fprintf( stderr, "The output pattern needs exactly one integer conversion for the frame number, like reel_%%06d.dng\n" );
+            goto fail;
+        }
+        pos = args;
+        npos = nargs;
+    }
+    else if( npos < 0 )
+        goto usage;
+
+    if( npos > 0 ) // runtime-specified CFA pattern (useful if the image is flipped/rotated)
+        opt.cfa = atoi( pos[0] );
+    if( opt.cfa > 3 || opt.cfa < 0 )
+        goto usage;
+
+    if( npos > 1 )
+        opt.compression = atoi( pos[1] );
+    if( opt.compression != COMPRESSION_NONE && opt.compression != COMPRESSION_JPEG &&
+        opt.compression != COMPRESSION_ADOBE_DEFLATE )
+        goto usage;
+    // The point transform has to leave at least one bit of each sample
+    if( opt.near_lossless >= sample_bits( &opt ) )
+        goto usage;
+    // Only lossless JPEG is encoded a row at a time, and without restart intervals.
+    // An estimate encodes nothing for real, so the whole frame is read as usual.
+    if( opt.estimate )
+        opt.low_memory = 0;
+    if( opt.low_memory && (opt.compression != COMPRESSION_JPEG || opt.restart) )
+        goto usage;
+
+    if( npos > 2 )
+        opt.reelname = pos[2];
+
+    int frame = 0;
+    if( npos > 3 )
+        frame = atoi( pos[3] );
+    if( frame < 0 )
+        goto usage;
+
+    // Frames of a sequence are alike, so a table trained on one tile serves the ones after it
+    if( batch_list || stream_path )
+        opt.reuse_tables = 1;
+
+    if( !batch_list && !stream_path && opt.estimate )
+    {
+        frame_batch batch = { 0 };
+        batch.inputs = args;
+        batch.count = 1;
+        batch.start_frame = frame;
+        return run_estimate( &batch, &opt, threads );
+    }
+    if( !batch_list && !stream_path )
+    {
+        converter conv = { 0 };
+        conv.opt = &opt;
+        seed_converter( &conv );
+        if( (conv.pool = tpool_create( threads )) == NULL ||
+            (conv.scratch = create_scratch( conv.pool )) == NULL )
+        {
+            tpool_destroy( conv.pool );
+            fprintf( stderr, "Unable to create worker threads.\n" );
+            goto fail;
+        }
+        status = convert_frame( &conv, args[0], args[1], frame );
+        free_scratch( conv.scratch, conv.pool );
+        tpool_destroy( conv.pool );
+        free_converter( &conv );
+        return status;
+    }
+
+    frame_batch batch = { 0 };
+    batch.output_pattern = output_pattern;
+    batch.start_frame = start_frame;
+    batch.ordered = ordered;
+
+    // A stream is read in order by the pipeline's reader, however long it turns out to be
+    if( stream_path )
+    {
+        if( (batch.stream = raw_stream_open( stream_path, raw_size[0], raw_size[1] )) == NULL )
+        {
+            perror( stream_path );
+            goto fail;
+        }
+        batch.stream_path = stream_path;
+        batch.stream_size[0] = raw_size[0];
+        batch.stream_size[1] = raw_size[1];
+        batch.count = batch.first_failure = INT_MAX;
+        if( !read_depth )
+            read_depth = write_depth = 2;
+        status = opt.estimate ? run_estimate( &batch, &opt, threads ) : run_pipeline( &batch, &opt, threads, read_depth, write_depth );
+        raw_stream_close( batch.stream );
+        return status;
+    }
+
+    batch.inputs = read_input_list( batch_list, &batch.count );
+    batch.first_failure = batch.count;
+    if( !batch.inputs || !batch.count )
+    {
+        fprintf( stderr, "%s: no input files\n", batch_list );
+        goto fail;
+    }
+
+    if( read_depth || opt.estimate )
+    {
+        status = opt.estimate ? run_estimate( &batch, &opt, threads ) : run_pipeline( &batch, &opt, threads, read_depth, write_depth );
+        for( int i = 0; i < batch.count; i++ )
+            free( batch.inputs[i] );
+        free( batch.inputs );
+        return status;
+    }
+
+    // Every frame in flight needs its own converter, and spawns its tiles on the shared pool
+    if( jobs == 0 )
+        jobs = threads;
+    if( jobs > batch.count )
+        jobs = batch.count;
+    batch.convs = calloc( jobs, sizeof( converter ) );
+    batch.idle = calloc( jobs, sizeof( converter* ) );
+    batch.written = calloc( batch.count, 1 );
+    batch.pool = tpool_create( threads );
+    tile_scratch *scratch = batch.pool ? create_scratch( batch.pool ) : NULL;
+    if( !batch.convs || !batch.idle || !batch.written || !scratch )
+    {
+        fprintf( stderr, "Unable to create worker threads.\n" );
+        goto fail;
+    }
+    for( int i = 0; i < jobs; i++ )
+    {
+        converter *conv = &batch.convs[i];
+        conv->opt = &opt;
+        conv->pool = batch.pool;
+        conv->scratch = scratch;
+        seed_converter( conv );
+        batch.idle[batch.idle_count++] = conv;
+    }
+    mutex_init( &batch.lock );
+    mutex_lock( &batch.lock );
+    while( batch.next < jobs )
+        tpool_spawn( batch.pool, &batch.frames, frame_task, &batch, batch.next++ );
+    mutex_unlock( &batch.lock );
+    tpool_wait( batch.pool, &batch.frames );
+    mutex_destroy( &batch.lock );
+    free_scratch( scratch, batch.pool );
+    tpool_destroy( batch.pool );
+    status = batch.first_failure < batch.count;
+
+    // Anything written after a failure never gets its final name
+    char output[4096], temp[4096 + 8];
+    for( int i = batch.finalize; ordered && i < batch.count; i++ )
+    {
+        frame_names( &batch, i, output, sizeof( output ), temp, sizeof( temp ) );
+        if( batch.written[i] )
+            remove( temp );
+    }
+
+    for( int i = 0; i < jobs; i++ )
+        free_converter( &batch.convs[i] );
+    free( batch.convs );
+    free( batch.idle );
+    free( batch.written );
+    for( int i = 0; i < batch.count; i++ )
+        free( batch.inputs[i] );
+    free( batch.inputs );
     return status;
 usage:
-    printf( "usage: makeDNG input_tiff_file output_dng_file [cfa_pattern] [compression]\n" );
-    printf( "               [reelname] [frame number]\n\n" );
+    printf( "usage: makeDNG [options] input_tiff_file output_dng_file [cfa_pattern] [compression]\n" );
+    printf( "               [reelname] [frame number]\n" );
+    printf( "       makeDNG [options] --batch list --output pattern [--start N] [cfa_pattern]\n" );
+    printf( "               [compression] [reelname]\n" );
+    printf( "       makeDNG [options] --stream file --raw WxHxBITS --output pattern [--start N]\n" );
+    printf( "               [cfa_pattern] [compression] [reelname]\n" );
+    printf( "       makeDNG [options] --estimate N input_tiff_file | --batch list | --stream file\n" );
+    printf( "               [cfa_pattern] ...\n\n" );
+    printf( "       --threads N   convert frames and compress tiles on N threads\n" );
+    printf( "                     (default: one per CPU)\n" );
+    printf( "       --tile WxH    tile size for compressed output, multiples of 16\n" );
+    printf( "                     (default: two tiles side by side)\n" );
+    printf( "       --batch list  convert every file named in list, one per line (- for stdin),\n" );
+    printf( "                     or matching a quoted glob pattern like \"scans/*.tif\"\n" );
+    printf( "       --output pat  output file name with the frame number, like reel_%%06d.dng\n" );
+    printf( "       --start N     frame number of the first file in a batch (default: 1)\n" );
+    printf( "       --jobs N      keep at most N frames of a batch in flight, sharing the\n" );
+    printf( "                     threads with their tiles (default: one per thread)\n" );
+    printf( "       --ordered     finish batch outputs strictly in frame order\n" );
+    printf( "       --pipeline R:W  read, compress and write a batch in overlapping stages,\n" );
+    printf( "                     with up to R frames read ahead and W waiting to be written\n" );
+    printf( "       --stream file convert headerless 16-bit frames stored back to back in a\n" );
+    printf( "                     file, or - for stdin, using the pipeline (default 2:2)\n" );
+    printf( "       --raw WxHxBITS  frame size and significant bits of each --stream sample\n" );
+    printf( "       --bits N[:msb]  significant bits of each sample, at the bottom of the\n" );
+    printf( "                     16-bit word or, with :msb, at the top (default: 16)\n" );
+    printf( "       --predictor N lossless JPEG predictor 1-7, or auto to pick the smallest\n" );
+    printf( "                     for each tile (default: 6)\n" );
+    printf( "       --restart N   restart lossless JPEG prediction every N rows of a tile,\n" );
+    printf( "                     encoding the intervals of a tile in parallel\n" );
+    printf( "       --near-lossless N  drop the N lowest bits of each sample from lossless\n" );
+    printf( "                     JPEG tiles, for smaller proxies and review copies\n" );
+    printf( "       --low-memory  encode lossless JPEG tiles from the input's scanlines as\n" );
+    printf( "                     they're read, without holding the whole frame\n" );
+    printf( "       --min-gain P  write lossless JPEG frames that wouldn't be at least P%%\n" );
+    printf( "                     smaller uncompressed instead (default: 0)\n" );
+    printf( "       --estimate N  write nothing, only print what every Nth frame would take\n" );
+    printf( "                     with each compression and project the totals\n" );
+    printf( "       --report      print the size of each compressed tile\n\n" );
     printf( "       cfa_pattern 0: BGGR\n" );
     printf( "                   1: GBRG\n" );
     printf( "                   2: GRBG\n" );
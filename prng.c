@@ -3,7 +3,9 @@
  * pseudo-random number generator based on the alleged RC4
  * cipher.  This PRNG should be suitable for most general-purpose
  * uses.  Not recommended for cryptographic or financial
- * purposes.  Not thread-safe.
+ * purposes.  The prng_* functions share one global state and are
+ * not thread-safe; give each thread its own struct prng and use
+ * the prng_r_* functions instead.
  */
 
 /*
@@ -46,9 +48,8 @@
 #include <math.h>
 #include <time.h>
 
-/* RC4-based pseudo-random state. */
-static unsigned char s[256];
-static int s_i, s_j;
+/* Global state behind the prng_* functions. */
+static struct prng global;
 
 /* Nonzero if PRNG has been seeded. */
 static int seeded;
@@ -114,6 +115,16 @@ get_octet (const void *bytes_, size_t n_bytes, size_t octet_idx)
 void
 prng_seed_bytes (const void *key, size_t size) 
 {
+  prng_r_seed_bytes (&global, key, size);
+  seeded = 1;
+}
+
+/* Seeds the pseudo-random state RNG based on the SIZE bytes in
+   KEY.  At most the first 2048 bits in KEY are used. */
+void
+prng_r_seed_bytes (struct prng *rng, const void *key, size_t size) 
+{
+  unsigned char *s = rng->s;
   int i, j;
 
   assert (key != NULL && size > 0);
@@ -126,8 +137,7 @@ prng_seed_bytes (const void *key, size_t size)
       SWAP_BYTE (s + i, s + j);
     }
 
-  s_i = s_j = 0;
-  seeded = 1;
+  rng->i = rng->j = 0;
 }
 
 /* Returns a pseudo-random integer in the range [0, 255]. */
@@ -137,11 +147,22 @@ prng_get_octet (void)
   if (!seeded) 
     prng_seed_time ();
 
-  s_i = (s_i + 1) & 255;
-  s_j = (s_j + s[s_i]) & 255;
-  SWAP_BYTE (s + s_i, s + s_j);
+  return prng_r_get_octet (&global);
+}
+
+/* Returns a pseudo-random integer in the range [0, 255] from the
+   state RNG, which must have been seeded with
+   prng_r_seed_bytes(). */
+unsigned char
+prng_r_get_octet (struct prng *rng)
+{
+  unsigned char *s = rng->s;
+
+  rng->i = (rng->i + 1) & 255;
+  rng->j = (rng->j + s[rng->i]) & 255;
+  SWAP_BYTE (s + rng->i, s + rng->j);
 
-  return s[(s[s_i] + s[s_j]) & 255];
+  return s[(s[rng->i] + s[rng->j]) & 255];
 }
 
 /* Returns a pseudo-random integer in the range [0, UCHAR_MAX]. */
@@ -167,6 +188,22 @@ prng_get_bytes (void *buf_, size_t size)
     *buf = prng_get_byte (); 
 }
 
+/* Fills BUF with SIZE pseudo-random bytes from the state RNG. */
+void
+prng_r_get_bytes (struct prng *rng, void *buf_, size_t size) 
+{
+  unsigned char *buf;
+  int bits;
+
+  for (buf = buf_; size-- > 0; buf++)
+    {
+      unsigned byte = prng_r_get_octet (rng);
+      for (bits = 8; bits < CHAR_BIT; bits += 8) 
+        byte = (byte << 8) | prng_r_get_octet (rng);
+      *buf = byte;
+    }
+}
+
 /* Returns a pseudo-random unsigned long in the range [0,
    ULONG_MAX]. */
 unsigned long
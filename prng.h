@@ -3,6 +3,14 @@
 
 #include <stddef.h>
 
+/* RC4-based pseudo-random state, for callers that need one per
+   thread. */
+struct prng
+  {
+    unsigned char s[256];
+    int i, j;
+  };
+
 void prng_seed_time (void);
 void prng_seed_bytes (const void *, size_t);
 unsigned char prng_get_octet (void);
@@ -15,4 +23,8 @@ int prng_get_int (void);
 double prng_get_double (void);
 double prng_get_double_normal (void);
 
+void prng_r_seed_bytes (struct prng *, const void *, size_t);
+unsigned char prng_r_get_octet (struct prng *);
+void prng_r_get_bytes (struct prng *, void *, size_t);
+
 #endif /* prng.h */
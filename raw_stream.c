@@ -0,0 +1,125 @@
+/*****************************************************************************
+ * raw_stream: headerless 16-bit Bayer frames stored back to back
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // fileno
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "raw_stream.h"
+
+struct raw_stream
+{
+    FILE *file;             // Streamed when it can't be mapped
+    uint8_t *map;
+    size_t map_size;
+    size_t frame_size;
+    size_t next;            // Offset of the next frame in the map, or bytes of a short read
+    int ended;
+};
+
+raw_stream *raw_stream_open( const char *path, uint32_t width, uint32_t height )
+{
+    raw_stream *s = calloc( 1, sizeof( raw_stream ) );
+    if( !s )
+        return NULL;
+    s->frame_size = (size_t)width * height * 2;
+
+    if( !strcmp( path, "-" ) )
+    {
+        s->file = stdin;
+#ifdef _WIN32
+        _setmode( _fileno( stdin ), _O_BINARY );
+#endif
+    }
+    else if( (s->file = fopen( path, "rb" )) == NULL )
+    {
+        free( s );
+        return NULL;
+    }
+
+#ifndef _WIN32
+    // A capture file can be mapped whole and its frames handed out in place
+    struct stat st;
+    if( !fstat( fileno( s->file ), &st ) && S_ISREG( st.st_mode ) && st.st_size > 0 )
+    {
+        void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno( s->file ), 0 );
+        if( map != MAP_FAILED )
+        {
+            posix_madvise( map, st.st_size, POSIX_MADV_SEQUENTIAL );
+            s->map = map;
+            s->map_size = st.st_size;
+        }
+    }
+#endif
+    return s;
+}
+
+size_t raw_stream_frame_size( const raw_stream *s )
+{
+    return s->frame_size;
+}
+
+int raw_stream_read( raw_stream *s, uint8_t *buf, const uint8_t **frame )
+{
+    if( s->ended )
+        return 0;
+    if( s->map )
+    {
+        if( s->map_size - s->next >= s->frame_size )
+        {
+            *frame = s->map + s->next;
+            s->next += s->frame_size;
+            return 1;
+        }
+    }
+    else
+    {
+        size_t got = fread( buf, 1, s->frame_size, s->file );
+        if( got == s->frame_size )
+        {
+            *frame = buf;
+            return 1;
+        }
+        s->next = got;
+    }
+
+    // Anything left over is a partial frame
+    s->ended = 1;
+    if( s->map )
+        return s->next == s->map_size ? 0 : -1;
+    return s->next == 0 && !ferror( s->file ) ? 0 : -1;
+}
+
+void raw_stream_close( raw_stream *s )
+{
+    if( !s )
+        return;
+#ifndef _WIN32
+    if( s->map )
+        munmap( s->map, s->map_size );
+#endif
+    if( s->file && s->file != stdin )
+        fclose( s->file );
+    free( s );
+}
@@ -0,0 +1,42 @@
+/*****************************************************************************
+ * raw_stream: headerless 16-bit Bayer frames stored back to back
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef RAW_STREAM_H
+#define RAW_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct raw_stream raw_stream;
+
+/*
+ * Open a file, or stdin for "-", holding frames of width x height 16-bit
+ * samples in this machine's byte order. Regular files are memory mapped so
+ * frames are used in place, anything else (pipes, terminals) is read in
+ * sequence. Returns NULL and sets errno on failure.
+ */
+raw_stream *raw_stream_open( const char *path, uint32_t width, uint32_t height );
+
+size_t raw_stream_frame_size( const raw_stream *s );
+
+/*
+ * Get the next frame, either in place or read into buf, which must hold
+ * raw_stream_frame_size bytes. Returns 1 with *frame set, 0 at the end of the
+ * stream, or -1 on a read error or a truncated last frame, after which it
+ * returns 0. Only one thread may read at a time; frames in place stay valid
+ * until raw_stream_close.
+ */
+int raw_stream_read( raw_stream *s, uint8_t *buf, const uint8_t **frame );
+
+void raw_stream_close( raw_stream *s );
+
+#endif
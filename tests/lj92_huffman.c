@@ -0,0 +1,254 @@
+/*
+ * Checks the huffman tables the LJ92 encoder builds against the optimum for
+ * their histograms. Each image is one row predicted from the left, with the
+ * difference of every pixel picked to land in a chosen category, so the
+ * histogram of categories is known. The code lengths are read back from the
+ * DHT segment and have to
+ * - spend exactly as many bits on the histogram as the best length-limited
+ *   code, found by a brute force search,
+ * - be no longer than 16 bits,
+ * - keep the Kraft sum at most 1, and
+ * - leave the all-ones code unused, as the standard reserves it.
+ *
+ * From the base directory:
+ *   gcc -std=c99 -Wall -I. tests/lj92_huffman.c lj92.c -o lj92_huffman -lm -lpthread && ./lj92_huffman
+ * Exits with 1 and names the histogram if any of them fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lj92.h"
+
+#define CATEGORIES 17
+#define MAX_BITS 16
+#define MAX_WIDTH 60000
+
+static uint32_t seed = 1;
+
+static uint32_t next_random( void )
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+/*
+ * Fewest code bits any prefix code with lengths of 1 to 16 can spend on hist
+ * while leaving at least one code unused. The categories in use are sorted
+ * by count and given codes level by level, top down: at each level some of
+ * the next ones become leaves and the rest of the open nodes split in two,
+ * which costs one bit for every category still without a code.
+ */
+static int64_t optimum_bits( const int *hist )
+{
+    int64_t count[CATEGORIES], below[CATEGORIES + 1];
+    // best[i][a]: cheapest way to the current level with i categories coded and a open nodes
+    int64_t best[CATEGORIES + 1][CATEGORIES + 2], next[CATEGORIES + 1][CATEGORIES + 2];
+    int n = 0;
+
+    for( int s = 0; s < CATEGORIES; s++ )
+    {
+        if( hist[s] <= 0 )
+            continue;
+        int k = n++;
+        for( ; k > 0 && count[k - 1] < hist[s]; k-- )
+            count[k] = count[k - 1];
+        count[k] = hist[s];
+    }
+    if( n == 0 )
+        return 0;
+    below[n] = 0;
+    for( int i = n - 1; i >= 0; i-- )
+        below[i] = below[i + 1] + count[i];
+
+    for( int i = 0; i <= n; i++ )
+        for( int a = 0; a <= n + 1; a++ )
+            best[i][a] = -1;
+    best[0][2] = below[0]; // The root's two children, one bit for everything
+    int64_t answer = -1;
+    for( int level = 1; level <= MAX_BITS; level++ )
+    {
+        for( int i = 0; i <= n; i++ )
+            for( int a = 0; a <= n + 1; a++ )
+                next[i][a] = -1;
+        for( int i = 0; i < n; i++ )
+            for( int a = 1; a <= n + 1; a++ )
+            {
+                if( best[i][a] < 0 )
+                    continue;
+                for( int j = 1; j <= a && i + j <= n; j++ )
+                {
+                    int open = a - j;
+                    if( i + j == n )
+                    {
+                        // Done, as long as a node is left over for the reserved code
+                        if( open > 0 && (answer < 0 || best[i][a] < answer) )
+                            answer = best[i][a];
+                        continue;
+                    }
+                    // More open nodes than categories left, plus the spare, never help
+                    int split = 2 * open > n - i - j + 1 ? n - i - j + 1 : 2 * open;
+                    int64_t cost = best[i][a] + below[i + j];
+                    if( split > 0 && (next[i + j][split] < 0 || cost < next[i + j][split]) )
+                        next[i + j][split] = cost;
+                }
+                // Or no leaves at this level at all
+                int split = 2 * a > n - i + 1 ? n - i + 1 : 2 * a;
+                int64_t cost = best[i][a] + below[i];
+                if( next[i][split] < 0 || cost < next[i][split] )
+                    next[i][split] = cost;
+            }
+        memcpy( best, next, sizeof( best ) );
+    }
+    return answer;
+}
+
+// Fill a row whose left-predicted differences have the categories counted in hist
+static int fill_row( uint16_t *row, const int *hist )
+{
+    int left[CATEGORIES], width = 0;
+    uint32_t previous = 32768; // What the first pixel is predicted from
+
+    for( int s = 0; s < CATEGORIES; s++ )
+        width += left[s] = hist[s];
+    for( int x = 0; x < width; x++ )
+    {
+        // The categories in a random order
+        uint32_t pick = next_random() % (width - x);
+        int s = 0;
+        while( pick >= (uint32_t)left[s] )
+            pick -= left[s++];
+        left[s]--;
+        uint32_t diff = s == 0 ? 0 : s == 16 ? 32768 : (1u << (s - 1)) + next_random() % (1u << (s - 1));
+        // Step towards the middle so the sample stays in range
+        previous = previous >= 32768 ? previous - diff : previous + diff;
+        row[x] = (uint16_t)previous;
+    }
+    return width;
+}
+
+static int check_histogram( lj92_encoder encoder, const char *name, const int *hist )
+{
+    static uint16_t row[MAX_WIDTH];
+    uint8_t *encoded;
+    int length, width = 0;
+
+    for( int s = 0; s < CATEGORIES; s++ )
+        width += hist[s];
+    if( width > MAX_WIDTH )
+    {
+        fprintf( stderr, "%s: %d pixels is too many for a row\n", name, width );
+        return 1;
+    }
+    fill_row( row, hist );
+
+    if( lj92_encoder_encode( encoder, row, width, 1, 16, 1, width, 0, NULL, 0, &encoded, &length ) != LJ92_ERROR_NONE )
+    {
+        fprintf( stderr, "%s: encoding failed\n", name );
+        return 1;
+    }
+    // The DHT segment: its length, the table class and id, codes of each length, then the categories in order
+    int at = 2;
+    while( at + 4 <= length && !(encoded[at] == 0xFF && encoded[at + 1] == 0xC4) )
+        at += 2 + (encoded[at + 2] << 8 | encoded[at + 3]);
+    if( at + 5 + MAX_BITS > length )
+    {
+        fprintf( stderr, "%s: no DHT segment\n", name );
+        return 1;
+    }
+    const uint8_t *bits = &encoded[at + 5], *value = bits + MAX_BITS;
+    int codesize[CATEGORIES] = { 0 }, kraft = 0, failed = 0;
+    uint32_t code = 0;
+    for( int l = 1, k = 0; l <= MAX_BITS; l++, code <<= 1 )
+        for( int c = 0; c < bits[l - 1]; c++, k++, code++ )
+        {
+            if( value[k] >= CATEGORIES || codesize[value[k]] )
+            {
+                fprintf( stderr, "%s: category %d listed twice or out of range\n", name, value[k] );
+                return 1;
+            }
+            codesize[value[k]] = l;
+            kraft += 1 << (MAX_BITS - l);
+            if( code == (1u << l) - 1 )
+            {
+                fprintf( stderr, "%s: category %d has the all-ones code\n", name, value[k] );
+                failed = 1;
+            }
+        }
+    if( kraft > 1 << MAX_BITS )
+    {
+        fprintf( stderr, "%s: Kraft sum %d/65536 is over 1\n", name, kraft );
+        failed = 1;
+    }
+    int64_t spent = 0;
+    for( int s = 0; s < CATEGORIES; s++ )
+    {
+        if( hist[s] && !codesize[s] )
+        {
+            fprintf( stderr, "%s: category %d has no code\n", name, s );
+            return 1;
+        }
+        spent += (int64_t)hist[s] * codesize[s];
+    }
+    int64_t optimum = optimum_bits( hist );
+    if( spent != optimum )
+    {
+        fprintf( stderr, "%s: %lld bits of codes, the optimum is %lld\n", name, (long long)spent, (long long)optimum );
+        failed = 1;
+    }
+    return failed;
+}
+
+int main( void )
+{
+    lj92_encoder encoder;
+    int hist[CATEGORIES];
+    char name[64];
+    int failed = 0;
+
+    if( lj92_encoder_create( &encoder ) != LJ92_ERROR_NONE )
+        return 1;
+    lj92_encoder_set_predictor( encoder, 1 );
+
+    // Uniformly random counts, some categories missing
+    for( int t = 0; t < 200; t++ )
+    {
+        int total = 0;
+        for( int s = 0; s < CATEGORIES; s++ )
+            total += hist[s] = next_random() % 4 ? next_random() % 3000 : 0;
+        hist[0] += total == 0;
+        snprintf( name, sizeof( name ), "random %d", t );
+        failed |= check_histogram( encoder, name, hist );
+    }
+    // Geometric, as the residuals of smooth images are: the rarest categories want codes over 16 bits
+    for( int t = 0; t < 100; t++ )
+    {
+        int peak = next_random() % CATEGORIES, count = 6000;
+        memset( hist, 0, sizeof( hist ) );
+        for( int d = 0; d < CATEGORIES && count; d++, count = count * (1 + t % 3) / (4 + t % 5) )
+        {
+            if( peak + d < CATEGORIES )
+                hist[peak + d] += count / 2 + 1;
+            if( d && peak - d >= 0 )
+                hist[peak - d] += count / 2 + 1;
+        }
+        snprintf( name, sizeof( name ), "geometric %d", t );
+        failed |= check_histogram( encoder, name, hist );
+    }
+    // Fibonacci counts make the deepest unlimited huffman tree there is
+    for( int s = 0, a = 1, b = 1; s < CATEGORIES; s++, b = a + b, a = b - a )
+        hist[s] = a;
+    failed |= check_histogram( encoder, "fibonacci", hist );
+    // Only one or two categories in use
+    memset( hist, 0, sizeof( hist ) );
+    hist[7] = 1000;
+    failed |= check_histogram( encoder, "one category", hist );
+    hist[16] = 1;
+    failed |= check_histogram( encoder, "two categories", hist );
+
+    lj92_encoder_destroy( encoder );
+    if( !failed )
+        printf( "lj92_huffman: every table is optimal\n" );
+    return failed;
+}
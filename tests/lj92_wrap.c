@@ -0,0 +1,88 @@
+/*
+ * Round trips images whose differences don't fit in 16 bits through the LJ92
+ * encoder and decoder. The standard takes differences modulo 2^16, so every
+ * category is at most 16 and a category of 16 is the difference 32768 with no
+ * bits after its code.
+ *
+ * From the base directory:
+ *   gcc -std=c99 -Wall -I. tests/lj92_wrap.c lj92.c -o lj92_wrap -lm -lpthread && ./lj92_wrap
+ * Exits with 1 and names the image if any of them fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lj92.h"
+
+// Encode and decode one image, returning the encoded length or -1 if it doesn't come back unchanged
+static int round_trip( const char *name, uint16_t *image, int width, int height )
+{
+    uint8_t *encoded = NULL;
+    int length = 0, w, h, bits;
+    lj92 lj;
+    uint16_t *decoded = calloc( (size_t)width * height, sizeof(uint16_t) );
+
+    if( decoded == NULL ||
+        lj92_encode( image, width, height, 16, width, 0, NULL, 0, &encoded, &length ) != LJ92_ERROR_NONE ||
+        lj92_open( &lj, encoded, length, &w, &h, &bits ) != LJ92_ERROR_NONE )
+    {
+        fprintf( stderr, "%s: encoding failed\n", name );
+        length = -1;
+        goto done;
+    }
+    if( w != width || h != height || lj92_decode( lj, decoded, width, 0, NULL, 0 ) != LJ92_ERROR_NONE ||
+        memcmp( decoded, image, (size_t)width * height * sizeof(uint16_t) ) )
+    {
+        fprintf( stderr, "%s: decoded image differs\n", name );
+        length = -1;
+    }
+    lj92_close( lj );
+done:
+    free( encoded );
+    free( decoded );
+    return length;
+}
+
+int main( void )
+{
+    const int width = 1024, height = 64;
+    uint16_t *image = malloc( (size_t)width * height * sizeof(uint16_t) );
+    int failed = 0;
+    uint32_t seed = 1;
+
+    // Full scale steps in both directions, and predictions above 65535 from the upper left
+    for( int y = 0; y < height; y++ )
+        for( int x = 0; x < width; x++ )
+            image[y * width + x] = ((x ^ y) & 1) ? 65535 : 0;
+    failed |= round_trip( "checkerboard", image, width, height ) < 0;
+
+    for( int y = 0; y < height; y++ )
+        for( int x = 0; x < width; x++ )
+            image[y * width + x] = (x / 3 + y) & 1 ? 65535 - x : x;
+    failed |= round_trip( "ramps", image, width, height ) < 0;
+
+    for( int i = 0; i < width * height; i++ )
+    {
+        seed = seed * 1103515245u + 12345u;
+        image[i] = seed >> 16;
+    }
+    failed |= round_trip( "noise", image, width, height ) < 0;
+
+    // Every difference is +-32768, category 16: one short code per sample and nothing after it
+    for( int x = 0; x < width; x++ )
+        image[x] = x & 1 ? 32768 : 0;
+    int length = round_trip( "32768", image, width, 1 );
+    if( length > width / 4 )
+    {
+        fprintf( stderr, "32768: %d bytes, category 16 was written with bits after its code\n", length );
+        failed = 1;
+    }
+    else
+        failed |= length < 0;
+
+    free( image );
+    if( !failed )
+        printf( "lj92_wrap: all images came back unchanged\n" );
+    return failed;
+}
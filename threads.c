@@ -0,0 +1,122 @@
+/*****************************************************************************
+ * threads: minimal portable wrappers around Win32 and POSIX threads
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <stdlib.h>
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "threads.h"
+
+// Win32 and pthreads disagree on the thread entry signature, so bounce through this
+typedef struct
+{
+    thread_func func;
+    void *arg;
+} thread_start;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry( LPVOID param )
+#else
+static void *thread_entry( void *param )
+#endif
+{
+    thread_start start = *(thread_start*)param;
+    free( param );
+    start.func( start.arg );
+    return 0;
+}
+
+int thread_create( thread_t *thread, thread_func func, void *arg )
+{
+    thread_start *start = malloc( sizeof( thread_start ) );
+    if( !start )
+        return -1;
+    start->func = func;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread( NULL, 0, thread_entry, start, 0, NULL );
+    if( *thread == NULL )
+#else
+    if( pthread_create( thread, NULL, thread_entry, start ) )
+#endif
+    {
+        free( start );
+        return -1;
+    }
+    return 0;
+}
+
+void thread_join( thread_t thread )
+{
+#ifdef _WIN32
+    WaitForSingleObject( thread, INFINITE );
+    CloseHandle( thread );
+#else
+    pthread_join( thread, NULL );
+#endif
+}
+
+#ifdef _WIN32
+void mutex_init( mutex_t *mutex )    { InitializeCriticalSection( mutex ); }
+void mutex_destroy( mutex_t *mutex ) { DeleteCriticalSection( mutex ); }
+void mutex_lock( mutex_t *mutex )    { EnterCriticalSection( mutex ); }
+void mutex_unlock( mutex_t *mutex )  { LeaveCriticalSection( mutex ); }
+
+void cond_init( cond_t *cond )                  { InitializeConditionVariable( cond ); }
+void cond_destroy( cond_t *cond )               { (void)cond; }
+void cond_wait( cond_t *cond, mutex_t *mutex )  { SleepConditionVariableCS( cond, mutex, INFINITE ); }
+void cond_signal( cond_t *cond )                { WakeConditionVariable( cond ); }
+void cond_broadcast( cond_t *cond )             { WakeAllConditionVariable( cond ); }
+
+int cpu_count( void )
+{
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+double clock_seconds( void )
+{
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter( &count );
+    QueryPerformanceFrequency( &frequency );
+    return (double)count.QuadPart / frequency.QuadPart;
+}
+#else
+void mutex_init( mutex_t *mutex )    { pthread_mutex_init( mutex, NULL ); }
+void mutex_destroy( mutex_t *mutex ) { pthread_mutex_destroy( mutex ); }
+void mutex_lock( mutex_t *mutex )    { pthread_mutex_lock( mutex ); }
+void mutex_unlock( mutex_t *mutex )  { pthread_mutex_unlock( mutex ); }
+
+void cond_init( cond_t *cond )                  { pthread_cond_init( cond, NULL ); }
+void cond_destroy( cond_t *cond )               { pthread_cond_destroy( cond ); }
+void cond_wait( cond_t *cond, mutex_t *mutex )  { pthread_cond_wait( cond, mutex ); }
+void cond_signal( cond_t *cond )                { pthread_cond_signal( cond ); }
+void cond_broadcast( cond_t *cond )             { pthread_cond_broadcast( cond ); }
+
+int cpu_count( void )
+{
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    return n > 0 ? (int)n : 1;
+}
+
+double clock_seconds( void )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+#endif
@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * threads: minimal portable wrappers around Win32 and POSIX threads
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec( thread )
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+typedef void (*thread_func)( void *arg );
+
+int thread_create( thread_t *thread, thread_func func, void *arg );
+void thread_join( thread_t thread );
+
+void mutex_init( mutex_t *mutex );
+void mutex_destroy( mutex_t *mutex );
+void mutex_lock( mutex_t *mutex );
+void mutex_unlock( mutex_t *mutex );
+
+void cond_init( cond_t *cond );
+void cond_destroy( cond_t *cond );
+void cond_wait( cond_t *cond, mutex_t *mutex );
+void cond_signal( cond_t *cond );
+void cond_broadcast( cond_t *cond );
+
+// Sequentially consistent atomic add, returning the new value
+static inline long atomic_add( volatile long *value, long delta )
+{
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd( value, delta ) + delta;
+#else
+    return __atomic_add_fetch( value, delta, __ATOMIC_SEQ_CST );
+#endif
+}
+
+static inline long atomic_get( volatile long *value )
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange( value, 0, 0 );
+#else
+    return __atomic_load_n( value, __ATOMIC_SEQ_CST );
+#endif
+}
+
+// Number of logical processors, or 1 if it can't be determined
+int cpu_count( void );
+
+// Seconds on a clock that only goes forward, for timing
+double clock_seconds( void );
+
+#endif
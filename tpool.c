@@ -0,0 +1,272 @@
+/*****************************************************************************
+ * tpool: a work-stealing thread pool for nested parallel jobs
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "threads.h"
+#include "tpool.h"
+
+typedef struct
+{
+    tpool_job job;
+    void *arg;
+    int index;
+    tpool_group *group;
+} task;
+
+// Ring buffer of tasks. The owner pushes and pops the tail, thieves take the head.
+typedef struct
+{
+    mutex_t lock;
+    task *tasks;
+    int capacity;       // Always a power of two
+    int head;
+    int count;
+} deque;
+
+typedef struct
+{
+    tpool *pool;
+    int index;
+} worker;
+
+struct tpool
+{
+    int size;           // Deques, one per requested thread including the caller
+    int running;        // Threads actually started including the caller
+    thread_t *threads;  // running - 1 background threads
+    worker *workers;
+    deque *deques;      // One per thread; deque 0 takes jobs from threads outside the pool
+    volatile long queued;   // Tasks sitting in any deque
+    volatile long sleepers;
+    mutex_t lock;       // Only guards sleeping and waking
+    cond_t wake;        // Signalled on new work, a finished group or shutdown
+    volatile long quit;
+};
+
+// The pool and deque the current thread works from
+static THREAD_LOCAL worker *current;
+
+static int deque_push( deque *d, const task *t )
+{
+    mutex_lock( &d->lock );
+    if( d->count == d->capacity )
+    {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        task *tasks = malloc( capacity * sizeof( task ) );
+        if( !tasks )
+        {
+            mutex_unlock( &d->lock );
+            return -1;
+        }
+        for( int i = 0; i < d->count; i++ )
+            tasks[i] = d->tasks[(d->head + i) & (d->capacity - 1)];
+        free( d->tasks );
+        d->tasks = tasks;
+        d->capacity = capacity;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->count++) & (d->capacity - 1)] = *t;
+    mutex_unlock( &d->lock );
+    return 0;
+}
+
+static int deque_pop( deque *d, task *t )
+{
+    int found = 0;
+    mutex_lock( &d->lock );
+    if( d->count > 0 )
+    {
+        *t = d->tasks[(d->head + --d->count) & (d->capacity - 1)];
+        found = 1;
+    }
+    mutex_unlock( &d->lock );
+    return found;
+}
+
+static int deque_steal( deque *d, task *t )
+{
+    int found = 0;
+    mutex_lock( &d->lock );
+    if( d->count > 0 )
+    {
+        *t = d->tasks[d->head];
+        d->head = (d->head + 1) & (d->capacity - 1);
+        d->count--;
+        found = 1;
+    }
+    mutex_unlock( &d->lock );
+    return found;
+}
+
+static int own_deque( const tpool *pool )
+{
+    return current && current->pool == pool ? current->index : 0;
+}
+
+static void wake( tpool *pool, int all )
+{
+    if( atomic_get( &pool->sleepers ) == 0 )
+        return;
+    mutex_lock( &pool->lock );
+    if( all )
+        cond_broadcast( &pool->wake );
+    else
+        cond_signal( &pool->wake );
+    mutex_unlock( &pool->lock );
+}
+
+// Run one task from our own deque, or failing that one stolen from another thread
+static int run_one( tpool *pool, int self )
+{
+    task t;
+    int found = deque_pop( &pool->deques[self], &t );
+    for( int i = 1; !found && i < pool->size; i++ )
+        found = deque_steal( &pool->deques[(self + i) % pool->size], &t );
+    if( !found )
+        return 0;
+    atomic_add( &pool->queued, -1 );
+    t.job( t.arg, t.index );
+    if( atomic_add( &t.group->pending, -1 ) == 0 )
+        wake( pool, 1 );
+    return 1;
+}
+
+// Sleep until there may be something to do. The sleeper count is raised before
+// checking the queue so a spawner either sees us or we see its task.
+static void idle( tpool *pool, tpool_group *group )
+{
+    mutex_lock( &pool->lock );
+    atomic_add( &pool->sleepers, 1 );
+    if( !atomic_get( &pool->quit ) && atomic_get( &pool->queued ) == 0 &&
+        (!group || atomic_get( &group->pending ) > 0) )
+        cond_wait( &pool->wake, &pool->lock );
+    atomic_add( &pool->sleepers, -1 );
+    mutex_unlock( &pool->lock );
+}
+
+static void worker_main( void *arg )
+{
+    worker *self = arg;
+    tpool *pool = self->pool;
+    current = self;
+    while( !atomic_get( &pool->quit ) )
+    {
+        if( !run_one( pool, self->index ) )
+            idle( pool, NULL );
+    }
+}
+
+tpool *tpool_create( int threads )
+{
+    tpool *pool = calloc( 1, sizeof( tpool ) );
+    if( !pool )
+        return NULL;
+    if( threads < 1 )
+        threads = 1;
+    pool->threads = calloc( threads, sizeof( thread_t ) );
+    pool->workers = calloc( threads, sizeof( worker ) );
+    pool->deques = calloc( threads, sizeof( deque ) );
+    if( !pool->threads || !pool->workers || !pool->deques )
+    {
+        free( pool->threads );
+        free( pool->workers );
+        free( pool->deques );
+        free( pool );
+        return NULL;
+    }
+    mutex_init( &pool->lock );
+    cond_init( &pool->wake );
+    for( int i = 0; i < threads; i++ )
+    {
+        mutex_init( &pool->deques[i].lock );
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    // Deques are all set up before any worker can go looking for a victim.
+    // A deque whose thread failed to start stays empty and is simply skipped.
+    pool->size = threads;
+    pool->running = 1;
+    while( pool->running < threads &&
+           !thread_create( &pool->threads[pool->running - 1], worker_main, &pool->workers[pool->running] ) )
+        pool->running++;
+    return pool;
+}
+
+void tpool_spawn( tpool *pool, tpool_group *group, tpool_job job, void *arg, int index )
+{
+    task t = { job, arg, index, group };
+    atomic_add( &group->pending, 1 );
+    if( deque_push( &pool->deques[own_deque( pool )], &t ) )
+    {
+        // Out of memory: run it now rather than lose it
+        job( arg, index );
+        if( atomic_add( &group->pending, -1 ) == 0 )
+            wake( pool, 1 );
+        return;
+    }
+    atomic_add( &pool->queued, 1 );
+    wake( pool, 0 );
+}
+
+void tpool_wait( tpool *pool, tpool_group *group )
+{
+    int self = own_deque( pool );
+    while( atomic_get( &group->pending ) > 0 )
+    {
+        if( !run_one( pool, self ) )
+            idle( pool, group );
+    }
+}
+
+void tpool_run( tpool *pool, int count, tpool_job job, void *arg )
+{
+    tpool_group group;
+    memset( &group, 0, sizeof( group ) );
+    for( int i = count - 1; i >= 0; i-- )
+        tpool_spawn( pool, &group, job, arg, i );
+    tpool_wait( pool, &group );
+}
+
+int tpool_size( const tpool *pool )
+{
+    return pool->running;
+}
+
+int tpool_thread( const tpool *pool )
+{
+    return own_deque( pool );
+}
+
+void tpool_destroy( tpool *pool )
+{
+    if( !pool )
+        return;
+    mutex_lock( &pool->lock );
+    atomic_add( &pool->quit, 1 );
+    cond_broadcast( &pool->wake );
+    mutex_unlock( &pool->lock );
+    for( int i = 0; i < pool->running - 1; i++ )
+        thread_join( pool->threads[i] );
+    for( int i = 0; i < pool->size; i++ )
+    {
+        free( pool->deques[i].tasks );
+        mutex_destroy( &pool->deques[i].lock );
+    }
+    free( pool->deques );
+    free( pool->workers );
+    free( pool->threads );
+    cond_destroy( &pool->wake );
+    mutex_destroy( &pool->lock );
+    free( pool );
+}
@@ -0,0 +1,62 @@
+/*****************************************************************************
+ * tpool: a work-stealing thread pool for nested parallel jobs
+ *****************************************************************************
+ * Copyright (C) 2018 Phillip Blucas
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *****************************************************************************/
+
+#ifndef TPOOL_H
+#define TPOOL_H
+
+typedef struct tpool tpool;
+
+typedef void (*tpool_job)( void *arg, int index );
+
+// Jobs that are waited on together. Zero-initialize before the first spawn.
+typedef struct
+{
+    volatile long pending;
+} tpool_group;
+
+/*
+ * Create a pool that runs jobs on the given number of threads, including the
+ * thread that waits on them. A pool of one thread runs everything inside
+ * tpool_wait on the calling thread.
+ */
+tpool *tpool_create( int threads );
+
+/*
+ * Queue job( arg, index ) as part of group. Jobs may spawn more jobs. Each
+ * thread pushes and pops its own deque in LIFO order, and idle threads steal
+ * the oldest jobs from the others, so big and small jobs share the same
+ * threads.
+ */
+void tpool_spawn( tpool *pool, tpool_group *group, tpool_job job, void *arg, int index );
+
+/*
+ * Return once every job in group has finished, running queued jobs (from
+ * any group) in the meantime. Jobs must not block on anything other than
+ * tpool_wait, or they can deadlock the jobs running beneath them.
+ */
+void tpool_wait( tpool *pool, tpool_group *group );
+
+// Run job( arg, i ) for every i in [0, count) and wait for them all
+void tpool_run( tpool *pool, int count, tpool_job job, void *arg );
+
+int tpool_size( const tpool *pool );
+
+/*
+ * Index of the calling thread in [0, tpool_size), for per-thread scratch
+ * space. Threads that aren't part of the pool all get 0, so only one of them
+ * should be running jobs at a time.
+ */
+int tpool_thread( const tpool *pool );
+
+void tpool_destroy( tpool *pool );
+
+#endif